@@ -0,0 +1,265 @@
+/*! buffered_rbtree.hpp */
+
+#ifndef _RBTREE_BUFFERED_RBTREE_HPP_
+#define _RBTREE_BUFFERED_RBTREE_HPP_
+
+#include <rbtree/rbtree.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _RBTREE_SSE2 1
+#endif
+
+namespace containers
+{
+
+// Whether keys equivalent under Comp are exactly the keys that compare
+// equal with ==, so that the staging buffer can be scanned with vector
+// compares. Only arithmetic keys of up to 8 bytes ordered by std::less or
+// std::greater.
+template<class Data, class Comp>
+struct _rbtree_simd_keys
+{
+    static const bool enabled = std::is_arithmetic<Data>::value && sizeof(Data) <= 8 &&
+        (std::is_same<Comp, std::less<Data>>::value || std::is_same<Comp, std::greater<Data>>::value);
+};
+
+#ifdef _RBTREE_SSE2
+// a register of copies of x, and lanewise equality as a byte mask
+
+template<class T>
+__m128i _rbtree_sse_splat(T x, std::integral_constant<std::size_t, 1>)
+{
+    return _mm_set1_epi8(char(x));
+}
+
+template<class T>
+__m128i _rbtree_sse_splat(T x, std::integral_constant<std::size_t, 2>)
+{
+    return _mm_set1_epi16(short(x));
+}
+
+template<class T>
+__m128i _rbtree_sse_splat(T x, std::integral_constant<std::size_t, 4>)
+{
+    return _mm_set1_epi32(int(x));
+}
+
+template<class T>
+__m128i _rbtree_sse_splat(T x, std::integral_constant<std::size_t, 8>)
+{
+    return _mm_set1_epi64x((long long)(x));
+}
+
+inline __m128i _rbtree_sse_eq(__m128i a, __m128i b, std::integral_constant<std::size_t, 1>)
+{
+    return _mm_cmpeq_epi8(a, b);
+}
+
+inline __m128i _rbtree_sse_eq(__m128i a, __m128i b, std::integral_constant<std::size_t, 2>)
+{
+    return _mm_cmpeq_epi16(a, b);
+}
+
+inline __m128i _rbtree_sse_eq(__m128i a, __m128i b, std::integral_constant<std::size_t, 4>)
+{
+    return _mm_cmpeq_epi32(a, b);
+}
+
+inline __m128i _rbtree_sse_eq(__m128i a, __m128i b, std::integral_constant<std::size_t, 8>)
+{
+    // SSE2 has no 64 bit compare: both 32 bit halves must match
+    auto const e = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(e, _mm_shuffle_epi32(e, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+// integers compare by bit pattern; floating point keys need the float
+// compare so that -0.0 and 0.0 match, as they do under std::less
+template<class T>
+int _rbtree_sse_match(T const* p, T x, std::false_type)
+{
+    using size = std::integral_constant<std::size_t, sizeof(T)>;
+    auto const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+    return _mm_movemask_epi8(_rbtree_sse_eq(v, _rbtree_sse_splat(x, size()), size()));
+}
+
+inline int _rbtree_sse_match(float const* p, float x, std::true_type)
+{
+    return _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(p), _mm_set1_ps(x)));
+}
+
+inline int _rbtree_sse_match(double const* p, double x, std::true_type)
+{
+    return _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(p), _mm_set1_pd(x)));
+}
+#endif
+
+// position of the first element of p[0, n) equivalent to x, or n
+template<class Data, class Comp>
+std::size_t _rbtree_buffer_find(Data const* p, std::size_t n, Data const& x, Comp const& comp, std::false_type)
+{
+    for (std::size_t i = 0; i < n; ++i) {
+        if (!comp(p[i], x) && !comp(x, p[i])) return i;
+    }
+    return n;
+}
+
+template<class Data, class Comp>
+std::size_t _rbtree_buffer_find(Data const* p, std::size_t n, Data const& x, Comp const&, std::true_type)
+{
+    std::size_t i = 0;
+#ifdef _RBTREE_SSE2
+    // 16 bytes per compare; a hit is located by the scalar loop below
+    std::size_t const w = 16 / sizeof(Data);
+    for (; i + w <= n; i += w) {
+        if (_rbtree_sse_match(p + i, x, typename std::is_floating_point<Data>::type()) != 0) break;
+    }
+#endif
+    for (; i < n; ++i) {
+        if (p[i] == x) return i;
+    }
+    return n;
+}
+
+// An rbtree that stages inserts in a small unsorted buffer. An insert
+// only checks the buffer and appends, without touching the tree. Once the
+// buffer holds capacity elements, or on flush(), it is sorted and merged
+// with rbtree::insert_batch, which searches for the whole batch at once
+// with overlapping cache misses and links the new nodes in key order.
+// Lookups and erases see both the tree and the buffer; the buffer is
+// scanned linearly, with SSE2 compares for arithmetic keys. Staged
+// duplicates of elements already in the tree are dropped when merged, so
+// size() looks each staged element up in the tree; ordered access goes
+// through tree(), which flushes.
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>>
+class buffered_rbtree
+{
+    using _tree = rbtree<Data, Comp, Alloc>;
+    using _simd = std::integral_constant<bool, _rbtree_simd_keys<Data, Comp>::enabled>;
+    // staged elements move into the tree unless that may throw, which
+    // would leave a half-moved element staged after a failed flush
+    using _move = std::integral_constant<bool, std::is_nothrow_move_constructible<Data>::value &&
+                                                   std::is_nothrow_move_assignable<Data>::value>;
+  public:
+    explicit buffered_rbtree(std::size_t capacity = 64) : m_capacity(capacity ? capacity : 1)
+    {
+        m_buf.reserve(m_capacity);
+    }
+
+    // O(buffered() log n): staged elements count unless the tree has them
+    std::size_t size() const
+    {
+        std::size_t n = m_tree.size();
+        for (auto const& d : m_buf) {
+            n += !m_tree.contains(d);
+        }
+        return n;
+    }
+
+    bool empty() const
+    {
+        return m_buf.empty() && m_tree.empty();
+    }
+
+    // elements staged and not yet merged
+    std::size_t buffered() const
+    {
+        return m_buf.size();
+    }
+
+    std::size_t buffer_capacity() const
+    {
+        return m_capacity;
+    }
+
+    void clear()
+    {
+        m_buf.clear();
+        m_tree.clear();
+    }
+
+    bool contains(Data const& d) const
+    {
+        return buffer_find(d) != m_buf.size() || m_tree.contains(d);
+    }
+
+    void insert(Data&& d)
+    {
+        if (buffer_find(d) != m_buf.size()) return;
+        m_buf.push_back(std::move(d));
+        if (m_buf.size() >= m_capacity) flush();
+    }
+
+    void insert(Data const& d)
+    {
+        if (buffer_find(d) != m_buf.size()) return;
+        m_buf.push_back(d);
+        if (m_buf.size() >= m_capacity) flush();
+    }
+
+    // d may be both staged and in the tree
+    bool erase(Data const& d)
+    {
+        auto const i = buffer_find(d);
+        bool const staged = i != m_buf.size();
+        if (staged) {
+            // the buffer is unordered; fill the hole with the last element
+            if (i + 1 != m_buf.size()) m_buf[i] = std::move(m_buf.back());
+            m_buf.pop_back();
+        }
+        return m_tree.erase(d) || staged;
+    }
+
+    // Merges the staged elements into the tree. If that throws, the ones
+    // already merged leave the buffer and the rest stay staged.
+    void flush()
+    {
+        if (m_buf.empty()) return;
+        std::sort(m_buf.begin(), m_buf.end(), m_comp);
+        std::size_t merged = 0;
+        try {
+            merge(merged, _move());
+        } catch (...) {
+            m_buf.erase(m_buf.begin(), m_buf.begin() + merged);
+            throw;
+        }
+        m_buf.clear();
+    }
+
+    // the tree holding every element, for ordered access and iteration
+    _tree const& tree()
+    {
+        flush();
+        return m_tree;
+    }
+
+  private:
+    _tree m_tree;
+    std::vector<Data, Alloc> m_buf;
+    std::size_t m_capacity;
+    Comp m_comp;
+
+    std::size_t buffer_find(Data const& d) const
+    {
+        return _rbtree_buffer_find(m_buf.data(), m_buf.size(), d, m_comp, _simd());
+    }
+
+    void merge(std::size_t& merged, std::true_type)
+    {
+        m_tree.insert_batch(std::make_move_iterator(m_buf.begin()), std::make_move_iterator(m_buf.end()), merged);
+    }
+
+    void merge(std::size_t& merged, std::false_type)
+    {
+        m_tree.insert_batch(m_buf.cbegin(), m_buf.cend(), merged);
+    }
+};
+
+} // namespace containers
+
+#endif // _RBTREE_BUFFERED_RBTREE_HPP_
@@ -0,0 +1,430 @@
+/*! compact_rbtree.hpp */
+
+#ifndef _RBTREE_COMPACT_RBTREE_HPP_
+#define _RBTREE_COMPACT_RBTREE_HPP_
+
+#include <rbtree/rbtree.hpp>
+
+#include <algorithm>
+#include <climits>
+
+namespace containers
+{
+
+// Node links without a parent pointer: the color lives in the low bit of the
+// left child pointer, so the per-node overhead is two words instead of three.
+struct _rbtree_compact_node_base
+{
+    uintptr_t m_left_color;
+    _rbtree_compact_node_base* m_right;
+    // access
+    _rbnode_color color() const
+    {
+        return static_cast<_rbnode_color>(m_left_color & uintptr_t(1));
+    }
+    _rbtree_compact_node_base* left() const
+    {
+        return (_rbtree_compact_node_base*)(m_left_color & ~uintptr_t(1));
+    }
+    _rbtree_compact_node_base* right() const
+    {
+        return m_right;
+    }
+    void set_color(_rbnode_color c)
+    {
+        auto left_col = m_left_color & ~uintptr_t(1);
+        left_col |= uintptr_t((c == _RED) ? 1 : 0);
+        m_left_color = left_col;
+    }
+    void set_left(_rbtree_compact_node_base* n)
+    {
+        auto n_int = (uintptr_t)n;
+        n_int |= (m_left_color & uintptr_t(1));
+        m_left_color = n_int;
+    }
+    void set_right(_rbtree_compact_node_base* n)
+    {
+        m_right = n;
+    }
+};
+
+template<class Data>
+struct _rbtree_compact_node : public _rbtree_compact_node_base
+{
+    Data m_data;
+    // access
+    Data const& data() const
+    {
+        return m_data;
+    }
+    _rbtree_compact_node* left() const
+    {
+        return static_cast<_rbtree_compact_node*>(_rbtree_compact_node_base::left());
+    }
+    _rbtree_compact_node* right() const
+    {
+        return static_cast<_rbtree_compact_node*>(_rbtree_compact_node_base::right());
+    }
+};
+
+constexpr std::size_t _rbtree_log2(std::size_t n)
+{
+    return n < 2 ? 0 : 1 + _rbtree_log2(n / 2);
+}
+
+class RBTREE_API _rbtree_compact_ops
+{
+  public:
+    // A red-black tree of height h has at least 2^(h/2) - 1 nodes, and the
+    // address space holds fewer than 2^bits / NodeSize nodes, so no path
+    // from the root is longer than this.
+    template<std::size_t NodeSize>
+    struct max_height
+    {
+        static const std::size_t value = 2 * (sizeof(void*) * CHAR_BIT - _rbtree_log2(NodeSize));
+    };
+
+    // diagnostic
+    static bool _verify(_rbtree_compact_node_base* n, size_t& black_ht);
+
+    // path[0] is the root and path[depth] the newly linked _RED node
+    static void insert_rebalance(_rbtree_compact_node_base** path, std::size_t depth,
+                                 _rbtree_compact_node_base** root);
+
+    // Unlinks node, whose ancestors are path[0, depth) from the root down,
+    // and restores the red-black properties along the path. path is reused
+    // as scratch space and needs room for the height of the tree plus one.
+    // The node itself is left for the caller to destroy.
+    static void erase(_rbtree_compact_node_base** path, std::size_t depth, _rbtree_compact_node_base* node,
+                      _rbtree_compact_node_base** root);
+};
+
+// Forward iterator holding the ancestors still to be visited. The stack is
+// sized for the deepest tree of such nodes that fits in memory, which makes
+// an iterator up to 121 words (968 bytes) on a 64 bit target; copying one,
+// as postfix ++ and begin() do, copies the whole array.
+template<class Data>
+class _compact_rbtree_iterator
+{
+    using _node = _rbtree_compact_node<Data>;
+    static const std::size_t _height = _rbtree_compact_ops::max_height<sizeof(_node)>::value;
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Data;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Data const*;
+    using reference = Data const&;
+
+    _compact_rbtree_iterator() : m_depth(0)
+    { }
+
+    // positions on n; stack holds the ancestors of n that are still to be
+    // visited, i.e. those whose left subtree contains n
+    _compact_rbtree_iterator(_node* const* stack, std::size_t depth) : m_depth(depth)
+    {
+        std::copy(stack, stack + depth, m_stack);
+    }
+
+    reference operator*() const
+    {
+        assert(m_depth > 0);
+        return m_stack[m_depth - 1]->data();
+    }
+
+    pointer operator->() const
+    {
+        return &(**this);
+    }
+
+    _compact_rbtree_iterator& operator++()
+    {
+        assert(m_depth > 0);
+        auto n = m_stack[--m_depth]->right();
+        while (n != nullptr) {
+            m_stack[m_depth++] = n;
+            n = n->left();
+        }
+        return *this;
+    }
+
+    _compact_rbtree_iterator operator++(int)
+    {
+        auto it = *this;
+        ++(*this);
+        return it;
+    }
+
+    bool operator==(_compact_rbtree_iterator const& o) const
+    {
+        if (m_depth == 0 || o.m_depth == 0) return m_depth == o.m_depth;
+        return m_stack[m_depth - 1] == o.m_stack[o.m_depth - 1];
+    }
+
+    bool operator!=(_compact_rbtree_iterator const& o) const
+    {
+        return !(*this == o);
+    }
+
+  private:
+    _node* m_stack[_height];
+    std::size_t m_depth;
+};
+
+template<class Data, class Alloc>
+using _compact_rbtree_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<_rbtree_compact_node<Data>>;
+
+// Red-black tree over parent-pointer-free nodes. Insertion and erase record
+// the path from the root during the descent and rebalance along it, and
+// iterators carry the same kind of bounded stack.
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>>
+class compact_rbtree : private _compact_rbtree_alloc<Data, Alloc>
+{
+    using _alloc = _compact_rbtree_alloc<Data, Alloc>;
+    using _alloc_traits = std::allocator_traits<_alloc>;
+    using _node = _rbtree_compact_node<Data>;
+    using _base = _rbtree_compact_node_base;
+    static const std::size_t _height = _rbtree_compact_ops::max_height<sizeof(_node)>::value;
+
+  public:
+    using const_iterator = _compact_rbtree_iterator<Data>;
+    using iterator = const_iterator;
+
+    compact_rbtree() : m_root(nullptr), m_size(0)
+    { }
+
+    ~compact_rbtree()
+    { clear(); }
+
+    // the nodes are owned, and copying them is not supported
+    compact_rbtree(compact_rbtree const&) = delete;
+    compact_rbtree& operator=(compact_rbtree const&) = delete;
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    void clear()
+    {
+        destroy_subtree(root());
+        m_root = nullptr;
+        m_size = 0;
+    }
+
+    const_iterator begin() const
+    {
+        _node* stack[_height];
+        std::size_t depth = 0;
+        for (auto n = root(); n != nullptr; n = n->left()) {
+            stack[depth++] = n;
+        }
+        return const_iterator(stack, depth);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator();
+    }
+
+    bool contains(Data const& d) const
+    {
+        auto n = root();
+        while (n != nullptr) {
+            if (m_comp(d, n->data())) {
+                n = n->left();
+            } else if (m_comp(n->data(), d)) {
+                n = n->right();
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool insert(Data&& d)
+    {
+        return insert_impl(std::move(d));
+    }
+
+    bool insert(Data const& d)
+    {
+        return insert_impl(d);
+    }
+
+    bool erase(Data const& d)
+    {
+        _base* path[_height + 1];
+        std::size_t depth = 0;
+        std::size_t cand_depth = 0;
+        _node* cand = nullptr;
+        // one comparison per level, as in insert; only the path down to the
+        // last node not less than d is kept
+        for (auto n = root(); n != nullptr;) {
+            if (m_comp(n->data(), d)) {
+                path[depth++] = n;
+                n = n->right();
+            } else {
+                cand = n;
+                cand_depth = depth;
+                path[depth++] = n;
+                n = n->left();
+            }
+        }
+        if (!cand || m_comp(d, cand->data())) return false;
+        _rbtree_compact_ops::erase(path, cand_depth, cand, &m_root);
+        destroy_node(cand);
+        assert(verify());
+        return true;
+    }
+
+    // range queries
+    const_iterator lower_bound(Data const& x) const
+    {
+        // keep only the ancestors at which the descent went left: those are
+        // exactly the nodes the iterator still has to visit
+        _node* stack[_height];
+        std::size_t depth = 0;
+        auto n = root();
+        while (n != nullptr) {
+            if (m_comp(n->data(), x)) {
+                n = n->right();
+            } else {
+                stack[depth++] = n;
+                n = n->left();
+            }
+        }
+        return const_iterator(stack, depth);
+    }
+
+    const_iterator upper_bound(Data const& x) const
+    {
+        _node* stack[_height];
+        std::size_t depth = 0;
+        auto n = root();
+        while (n != nullptr) {
+            if (m_comp(x, n->data())) {
+                stack[depth++] = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        return const_iterator(stack, depth);
+    }
+
+    // calls fn(data) in order for every element in [lo, hi)
+    template<class Fn>
+    void for_each_in_range(Data const& lo, Data const& hi, Fn fn) const
+    {
+        visit(root(), lo, hi, fn);
+    }
+
+  private:
+    _base* m_root;
+    std::size_t m_size;
+    Comp m_comp;
+
+    _node* root() const
+    {
+        return static_cast<_node*>(m_root);
+    }
+
+    template<class D>
+    bool insert_impl(D&& d)
+    {
+        _base* path[_height + 1];
+        std::size_t depth = 0;
+        auto n = root();
+        _node* cand = nullptr;
+        bool lt = false;
+        // one comparison per level; the last node not greater than d is the
+        // only possible duplicate
+        while (n != nullptr) {
+            path[depth++] = n;
+            lt = m_comp(d, n->data());
+            if (lt) {
+                n = n->left();
+            } else {
+                cand = n;
+                n = n->right();
+            }
+        }
+        if (cand && !m_comp(cand->data(), d)) return false;
+        n = create_node(std::forward<D>(d));
+        if (depth == 0) {
+            m_root = n;
+        } else if (lt) {
+            path[depth - 1]->set_left(n);
+        } else {
+            path[depth - 1]->set_right(n);
+        }
+        path[depth] = n;
+        _rbtree_compact_ops::insert_rebalance(path, depth, &m_root);
+        assert(verify());
+        return true;
+    }
+
+    template<class Fn>
+    void visit(_node* n, Data const& lo, Data const& hi, Fn& fn) const
+    {
+        while (n != nullptr) {
+            bool const ge_lo = !m_comp(n->data(), lo);
+            bool const lt_hi = m_comp(n->data(), hi);
+            if (ge_lo) visit(n->left(), lo, hi, fn);
+            if (ge_lo && lt_hi) fn(n->data());
+            if (!lt_hi) return;
+            n = n->right();
+        }
+    }
+
+    template<class D>
+    _node* create_node(D&& d)
+    {
+        auto node = _alloc_traits::allocate(*this, 1);
+        assert((((uintptr_t)node) & 1) == 0);
+        try {
+            ::new (static_cast<void*>(&node->m_data)) Data(std::forward<D>(d));
+        } catch(...) {
+            _alloc_traits::deallocate(*this, node, 1);
+            throw;
+        }
+        node->m_left_color = 0;
+        node->m_right = nullptr;
+        node->set_color(_RED);
+        ++m_size;
+        return node;
+    }
+
+    void destroy_node(_node* n)
+    {
+        n->m_data.~Data();
+        _alloc_traits::deallocate(*this, n, 1);
+        --m_size;
+    }
+
+    void destroy_subtree(_node* n)
+    {
+        while (n != nullptr) {
+            destroy_subtree(n->left());
+            auto r = n->right();
+            n->m_data.~Data();
+            _alloc_traits::deallocate(*this, n, 1);
+            n = r;
+        }
+    }
+
+    bool verify() const
+    {
+        size_t ht = 0;
+        return _rbtree_compact_ops::_verify(m_root, ht);
+    }
+};
+
+} // namespace containers
+
+#endif // _RBTREE_COMPACT_RBTREE_HPP_
@@ -0,0 +1,615 @@
+/*! fat_rbtree.hpp */
+
+#ifndef _RBTREE_FAT_RBTREE_HPP_
+#define _RBTREE_FAT_RBTREE_HPP_
+
+#include <rbtree/rbtree.hpp>
+
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _RBTREE_SSE2 1
+#endif
+
+namespace containers
+{
+
+// default keys per node: fill two cache lines, clamped to [8, 32]
+template<class Data>
+struct _fat_node_capacity
+{
+    static const std::size_t _raw = (128 - sizeof(_rbtree_node_base) - sizeof(std::size_t)) / sizeof(Data);
+    static const std::size_t value = _raw < 8 ? 8 : _raw > 32 ? 32 : _raw;
+};
+
+template<class Data, std::size_t K>
+struct _rbtree_fat_node : public _rbtree_node_base
+{
+    std::size_t m_count;
+    typename std::aligned_storage<sizeof(Data), alignof(Data)>::type m_slots[K];
+    // access
+    Data* keys()
+    {
+        return reinterpret_cast<Data*>(&m_slots[0]);
+    }
+    Data const* keys() const
+    {
+        return reinterpret_cast<Data const*>(&m_slots[0]);
+    }
+    Data const& min() const
+    {
+        assert(m_count > 0);
+        return keys()[0];
+    }
+    Data const& max() const
+    {
+        assert(m_count > 0);
+        return keys()[m_count - 1];
+    }
+    bool full() const
+    {
+        return m_count == K;
+    }
+    _rbtree_fat_node* parent() const
+    {
+        return static_cast<_rbtree_fat_node*>(_rbtree_node_base::parent());
+    }
+    _rbtree_fat_node* right() const
+    {
+        return static_cast<_rbtree_fat_node*>(_rbtree_node_base::right());
+    }
+    _rbtree_fat_node* left() const
+    {
+        return static_cast<_rbtree_fat_node*>(_rbtree_node_base::left());
+    }
+    _rbtree_fat_node* grandparent() const
+    {
+        return static_cast<_rbtree_fat_node*>(_rbtree_node_base::grandparent());
+    }
+    // key slot management
+    template<class D>
+    void insert_at(std::size_t i, D&& d)
+    {
+        assert(m_count < K && i <= m_count);
+        auto k = keys();
+        if (i == m_count) {
+            ::new (static_cast<void*>(k + i)) Data(std::forward<D>(d));
+        } else {
+            // make room by moving the tail up one slot; only the new last
+            // slot needs to be constructed
+            ::new (static_cast<void*>(k + m_count)) Data(std::move(k[m_count - 1]));
+            std::move_backward(k + i, k + m_count - 1, k + m_count);
+            k[i] = Data(std::forward<D>(d));
+        }
+        ++m_count;
+    }
+    void erase_at(std::size_t i)
+    {
+        assert(i < m_count);
+        auto k = keys();
+        std::move(k + i + 1, k + m_count, k + i);
+        k[--m_count].~Data();
+    }
+    // moves keys [from, m_count) to the end of o
+    void move_tail_to(std::size_t from, _rbtree_fat_node* o)
+    {
+        auto k = keys();
+        auto ok = o->keys();
+        assert(o->m_count + (m_count - from) <= K);
+        for (std::size_t i = from; i < m_count; ++i) {
+            ::new (static_cast<void*>(ok + o->m_count++)) Data(std::move(k[i]));
+            k[i].~Data();
+        }
+        m_count = from;
+    }
+};
+
+// number of keys in a node strictly less than x
+template<class Data, class Comp,
+         bool Packed = std::is_arithmetic<Data>::value && std::is_same<Comp, std::less<Data>>::value>
+struct _fat_node_search
+{
+    static std::size_t rank(Data const* keys, std::size_t n, Data const& x, Comp const& comp)
+    {
+        return std::size_t(std::lower_bound(keys, keys + n, x, comp) - keys);
+    }
+};
+
+// number of keys in p[0, n) less than x, counted without branches
+template<class Data>
+std::size_t _fat_count_less(Data const* p, std::size_t n, Data const& x)
+{
+    std::size_t r = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        r += std::size_t(p[i] < x);
+    }
+    return r;
+}
+
+#ifdef _RBTREE_SSE2
+// Lanewise a < b as a byte mask. SSE2 only compares signed integers, so
+// the sign bits given by _fat_sse_bias are flipped in both operands
+// first: that of every unsigned lane, and that of the low half of every
+// 64 bit lane. A 64 bit lane is then decided by its high halves, or by
+// its low halves when the high halves are equal.
+
+inline __m128i _fat_sse_lt(__m128i a, __m128i b, std::integral_constant<std::size_t, 1>)
+{
+    return _mm_cmplt_epi8(a, b);
+}
+
+inline __m128i _fat_sse_lt(__m128i a, __m128i b, std::integral_constant<std::size_t, 2>)
+{
+    return _mm_cmplt_epi16(a, b);
+}
+
+inline __m128i _fat_sse_lt(__m128i a, __m128i b, std::integral_constant<std::size_t, 4>)
+{
+    return _mm_cmplt_epi32(a, b);
+}
+
+inline __m128i _fat_sse_lt(__m128i a, __m128i b, std::integral_constant<std::size_t, 8>)
+{
+    auto const lt = _mm_cmplt_epi32(a, b);
+    auto const eq = _mm_cmpeq_epi32(a, b);
+    auto const r = _mm_or_si128(lt, _mm_and_si128(eq, _mm_shuffle_epi32(lt, _MM_SHUFFLE(2, 2, 0, 0))));
+    return _mm_shuffle_epi32(r, _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+// a register of copies of x
+template<class T>
+__m128i _fat_sse_splat(T x)
+{
+    T lanes[16 / sizeof(T)];
+    std::fill(lanes, lanes + 16 / sizeof(T), x);
+    return _mm_loadu_si128(reinterpret_cast<__m128i const*>(lanes));
+}
+
+template<class T>
+__m128i _fat_sse_bias()
+{
+    using U = typename std::make_unsigned<T>::type;
+    U const sign = U(U(1) << (8 * sizeof(T) - 1));
+    U const low = sizeof(T) == 8 ? U(0x80000000u) : U(0);
+    return _fat_sse_splat(U((std::is_unsigned<T>::value ? sign : U(0)) | low));
+}
+
+// How far the leading 16 byte blocks of p[0, n) hold only keys less than
+// x. The keys are sorted, so the rest of the count lies in the next block.
+template<class T>
+std::size_t _fat_sse_skip(T const* p, std::size_t n, T x, std::true_type /* integral */)
+{
+    using size = std::integral_constant<std::size_t, sizeof(T)>;
+    std::size_t const w = 16 / sizeof(T);
+    auto const bias = _fat_sse_bias<T>();
+    auto const vx = _mm_xor_si128(_fat_sse_splat(x), bias);
+    std::size_t i = 0;
+    for (; i + w <= n; i += w) {
+        auto const v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p + i)), bias);
+        if (_mm_movemask_epi8(_fat_sse_lt(v, vx, size())) != 0xffff) break;
+    }
+    return i;
+}
+
+inline std::size_t _fat_sse_skip(float const* p, std::size_t n, float x, std::false_type)
+{
+    auto const vx = _mm_set1_ps(x);
+    std::size_t i = 0;
+    for (; i + 4 <= n && _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(p + i), vx)) == 0xf; i += 4) { }
+    return i;
+}
+
+inline std::size_t _fat_sse_skip(double const* p, std::size_t n, double x, std::false_type)
+{
+    auto const vx = _mm_set1_pd(x);
+    std::size_t i = 0;
+    for (; i + 2 <= n && _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(p + i), vx)) == 0x3; i += 2) { }
+    return i;
+}
+#endif
+
+// Keys the SSE2 path compares: integers other than bool, float and double.
+template<class Data>
+struct _fat_sse_keys
+{
+    static const bool enabled = (std::is_integral<Data>::value && !std::is_same<Data, bool>::value) ||
+        std::is_same<Data, float>::value || std::is_same<Data, double>::value;
+};
+
+template<class Data, class Comp>
+struct _fat_node_search<Data, Comp, true>
+{
+    static std::size_t rank(Data const* keys, std::size_t n, Data const& x, Comp const&)
+    {
+        return rank(keys, n, x, std::integral_constant<bool, _fat_sse_keys<Data>::enabled>());
+    }
+
+  private:
+    static std::size_t rank(Data const* keys, std::size_t n, Data const& x, std::false_type)
+    {
+        return _fat_count_less(keys, n, x);
+    }
+
+    static std::size_t rank(Data const* keys, std::size_t n, Data const& x, std::true_type)
+    {
+#ifdef _RBTREE_SSE2
+        // packed compares over whole blocks, then at most one block of
+        // scalar ones: cheaper than a binary search at these node sizes
+        auto i = _fat_sse_skip(keys, n, x, typename std::is_integral<Data>::type());
+        while (i < n && keys[i] < x) {
+            ++i;
+        }
+        return i;
+#else
+        return _fat_count_less(keys, n, x);
+#endif
+    }
+};
+
+template<class Data, std::size_t K>
+class _fat_rbtree_iterator
+{
+    using _node = _rbtree_fat_node<Data, K>;
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Data;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Data const*;
+    using reference = Data const&;
+
+    _fat_rbtree_iterator() : m_node(nullptr), m_idx(0)
+    { }
+
+    _fat_rbtree_iterator(_node* n, std::size_t i) : m_node(n), m_idx(i)
+    { }
+
+    reference operator*() const
+    {
+        assert(m_node != nullptr && m_idx < m_node->m_count);
+        return m_node->keys()[m_idx];
+    }
+
+    pointer operator->() const
+    {
+        return &(**this);
+    }
+
+    _fat_rbtree_iterator& operator++()
+    {
+        if (++m_idx == m_node->m_count) {
+            m_node = static_cast<_node*>(_rbtree_ops::next(m_node));
+            m_idx = 0;
+        }
+        return *this;
+    }
+
+    _fat_rbtree_iterator operator++(int)
+    {
+        auto it = *this;
+        ++(*this);
+        return it;
+    }
+
+    bool operator==(_fat_rbtree_iterator const& o) const
+    {
+        return m_node == o.m_node && m_idx == o.m_idx;
+    }
+
+    bool operator!=(_fat_rbtree_iterator const& o) const
+    {
+        return !(*this == o);
+    }
+
+  private:
+    _node* m_node;
+    std::size_t m_idx;
+};
+
+template<class Data, std::size_t K, class Alloc>
+using _fat_rbtree_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<_rbtree_fat_node<Data, K>>;
+
+// Red-black tree whose nodes each hold a sorted run of up to K keys.
+// The runs are ordered like single keys in rbtree: every key of a node is
+// greater than all keys in its left subtree and less than all keys in its
+// right subtree. Full nodes split in two, sparse nodes merge with a neighbour,
+// and the red-black balancing applies between nodes.
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>,
+         std::size_t K = _fat_node_capacity<Data>::value>
+class fat_rbtree : private _fat_rbtree_alloc<Data, K, Alloc>
+{
+    static_assert(K >= 4, "fat_rbtree nodes need room for at least 4 keys");
+
+    using _alloc = _fat_rbtree_alloc<Data, K, Alloc>;
+    using _alloc_traits = std::allocator_traits<_alloc>;
+    using _node = _rbtree_fat_node<Data, K>;
+    using _search = _fat_node_search<Data, Comp>;
+
+  public:
+    using const_iterator = _fat_rbtree_iterator<Data, K>;
+    using iterator = const_iterator;
+
+    static const std::size_t node_capacity = K;
+
+    fat_rbtree() : m_root(nullptr), m_size(0), m_nodes(0)
+    { }
+
+    ~fat_rbtree()
+    { clear(); }
+
+    // the nodes are owned, and copying them is not supported
+    fat_rbtree(fat_rbtree const&) = delete;
+    fat_rbtree& operator=(fat_rbtree const&) = delete;
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    // number of tree nodes, for footprint comparisons
+    std::size_t node_count() const
+    {
+        return m_nodes;
+    }
+
+    void clear()
+    {
+        destroy_subtree(root());
+        m_root = nullptr;
+        m_size = 0;
+        m_nodes = 0;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(static_cast<_node*>(_rbtree_ops::minimum(m_root)), 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator();
+    }
+
+    bool contains(Data const& d) const
+    {
+        auto n = find_node(d);
+        if (!n) return false;
+        auto i = _search::rank(n->keys(), n->m_count, d, m_comp);
+        return i < n->m_count && !m_comp(d, n->keys()[i]);
+    }
+
+    bool insert(Data&& d)
+    {
+        return insert_impl(std::move(d));
+    }
+
+    bool insert(Data const& d)
+    {
+        return insert_impl(d);
+    }
+
+    bool erase(Data const& d)
+    {
+        auto n = find_node(d);
+        if (!n) return false;
+        auto i = _search::rank(n->keys(), n->m_count, d, m_comp);
+        if (i == n->m_count || m_comp(d, n->keys()[i])) return false;
+        n->erase_at(i);
+        --m_size;
+        if (n->m_count == 0) {
+            unlink_node(n);
+        } else if (n->m_count <= K / 4) {
+            merge_sparse(n);
+        }
+        assert(verify());
+        return true;
+    }
+
+    // range queries
+    const_iterator lower_bound(Data const& x) const
+    {
+        _node* p = nullptr;
+        _node* n = root();
+        while (n != nullptr) {
+            if (m_comp(n->max(), x)) {
+                n = n->right();
+            } else {
+                p = n;
+                if (!m_comp(x, n->min())) break;
+                n = n->left();
+            }
+        }
+        if (!p) return end();
+        return const_iterator(p, _search::rank(p->keys(), p->m_count, x, m_comp));
+    }
+
+    const_iterator upper_bound(Data const& x) const
+    {
+        auto it = lower_bound(x);
+        if (it != end() && !m_comp(x, *it)) ++it;
+        return it;
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(Data const& x) const
+    {
+        auto lb = lower_bound(x);
+        auto ub = lb;
+        if (ub != end() && !m_comp(x, *ub)) ++ub;
+        return std::make_pair(lb, ub);
+    }
+
+    // calls fn(data) in order for every element in [lo, hi)
+    template<class Fn>
+    void for_each_in_range(Data const& lo, Data const& hi, Fn fn) const
+    {
+        auto it = lower_bound(lo);
+        auto const e = end();
+        while (it != e && m_comp(*it, hi)) {
+            fn(*it);
+            ++it;
+        }
+    }
+
+  private:
+    _rbtree_node_base* m_root;
+    std::size_t m_size;
+    std::size_t m_nodes;
+    Comp m_comp;
+
+    _node* root() const
+    {
+        return static_cast<_node*>(m_root);
+    }
+
+    // node whose [min, max] would hold x, or null if x falls between nodes
+    _node* find_node(Data const& x) const
+    {
+        _node* n = root();
+        while (n != nullptr) {
+            if (m_comp(x, n->min())) {
+                n = n->left();
+            } else if (m_comp(n->max(), x)) {
+                n = n->right();
+            } else {
+                return n;
+            }
+        }
+        return nullptr;
+    }
+
+    template<class D>
+    bool insert_impl(D&& d)
+    {
+        if (!m_root) {
+            auto n = create_node();
+            n->insert_at(0, std::forward<D>(d));
+            n->set_color(_BLACK);
+            m_root = n;
+            ++m_size;
+            return true;
+        }
+        // descend to the node covering d, or to the last node visited, which
+        // is adjacent to d in key order
+        _node* last = nullptr;
+        _node* n = root();
+        while (n != nullptr) {
+            last = n;
+            if (m_comp(d, n->min())) {
+                n = n->left();
+            } else if (m_comp(n->max(), d)) {
+                n = n->right();
+            } else {
+                break;
+            }
+        }
+        n = last;
+        auto i = _search::rank(n->keys(), n->m_count, d, m_comp);
+        if (i < n->m_count && !m_comp(d, n->keys()[i])) return false;
+        if (n->full()) {
+            auto m = split(n);
+            if (i > n->m_count) {
+                i -= n->m_count;
+                n = m;
+            }
+        }
+        n->insert_at(i, std::forward<D>(d));
+        ++m_size;
+        assert(verify());
+        return true;
+    }
+
+    // moves the upper half of n into a new node linked as n's successor
+    _node* split(_node* n)
+    {
+        auto m = create_node();
+        n->move_tail_to(K / 2, m);
+        if (!n->right()) {
+            n->set_right(m);
+            m->set_parent(n);
+        } else {
+            auto s = _rbtree_ops::minimum(n->right());
+            s->set_left(m);
+            m->set_parent(s);
+        }
+        m->set_color(_RED);
+        _rbtree_node_base* r = m;
+        while (r && _rbtree_ops::insert_rebalance(r, &m_root)) {
+            r = r->grandparent();
+        }
+        return m;
+    }
+
+    // folds a sparse node into an in-order neighbour when both fit in one
+    // node, with headroom left so that the next insert does not split again
+    void merge_sparse(_node* n)
+    {
+        auto const limit = K - K / 4;
+        auto s = static_cast<_node*>(_rbtree_ops::next(n));
+        if (s && n->m_count + s->m_count <= limit) {
+            s->move_tail_to(0, n);
+            unlink_node(s);
+            return;
+        }
+        auto p = static_cast<_node*>(_rbtree_ops::prev(n));
+        if (p && n->m_count + p->m_count <= limit) {
+            n->move_tail_to(0, p);
+            unlink_node(n);
+        }
+    }
+
+    void unlink_node(_node* n)
+    {
+        _rbtree_ops::erase(n, &m_root);
+        destroy_node(n);
+    }
+
+    _node* create_node()
+    {
+        auto node = _alloc_traits::allocate(*this, 1);
+        assert((((uintptr_t)node) & 1) == 0);
+        node->m_parent_color = 0;
+        node->m_left = node->m_right = nullptr;
+        node->m_count = 0;
+        ++m_nodes;
+        return node;
+    }
+
+    void destroy_node(_node* node)
+    {
+        auto k = node->keys();
+        for (std::size_t i = 0; i < node->m_count; ++i) {
+            k[i].~Data();
+        }
+        --m_nodes;
+        _alloc_traits::deallocate(*this, node, 1);
+    }
+
+    void destroy_subtree(_node* n)
+    {
+        while (n != nullptr) {
+            destroy_subtree(n->left());
+            auto r = n->right();
+            destroy_node(n);
+            n = r;
+        }
+    }
+
+    bool verify() const
+    {
+        if (!m_root) return true;
+        size_t lh = 0, rh = 0;
+        bool lv = _rbtree_ops::_verify_black_ht(m_root->left(), lh);
+        bool rv = _rbtree_ops::_verify_black_ht(m_root->right(), rh);
+        return _rbtree_ops::_verify_rb_alt(m_root) && lv && rv && (lh == rh);
+    }
+};
+
+} // namespace containers
+
+#endif // _RBTREE_FAT_RBTREE_HPP_
@@ -0,0 +1,205 @@
+/*! hashed_rbtree.hpp */
+
+#ifndef _RBTREE_HASHED_RBTREE_HPP_
+#define _RBTREE_HASHED_RBTREE_HPP_
+
+#include <rbtree/rbtree.hpp>
+
+#include <functional>
+
+namespace containers
+{
+
+// Open-addressing table of pointers to the live nodes of a tree, keyed by
+// their data. Linear probing over a power-of-two table, with the hash
+// spread by a Fibonacci multiply so that patterned integer keys do not
+// cluster. Erasure shifts the rest of the cluster back instead of leaving
+// tombstones. Only node pointers are stored, so the overhead is one word
+// per slot, i.e. sizeof(void*) / load factor bytes per element.
+template<class Data, class Hash, class KeyEqual>
+class _rbtree_hash_index
+{
+    using _dnode = _rbtree_node<Data>;
+  public:
+    static const bool enabled = true;
+
+    _rbtree_hash_index() : m_shift(64), m_count(0), m_limit(0), m_max_load(0.5f)
+    { }
+
+    float max_load_factor() const
+    {
+        return m_max_load;
+    }
+
+    // lower factors trade memory for shorter probe sequences; the table is
+    // resized to the smallest one that the new factor allows
+    void max_load_factor(float f)
+    {
+        assert(f > 0 && f < 1);
+        m_max_load = f;
+        if (m_slots) rehash(min_buckets);
+    }
+
+    float load_factor() const
+    {
+        return bucket_count() ? float(m_count) / float(bucket_count()) : 0.0f;
+    }
+
+    std::size_t bucket_count() const
+    {
+        return m_slots ? std::size_t(1) << (64 - m_shift) : 0;
+    }
+
+    std::size_t index_bytes() const
+    {
+        return bucket_count() * sizeof(_rbtree_node_base*);
+    }
+
+    void index_reserve(std::size_t n)
+    {
+        if (n <= m_limit) return;
+        auto cap = bucket_count() ? bucket_count() : min_buckets;
+        while (n > std::size_t(float(cap) * m_max_load)) cap *= 2;
+        rehash(cap);
+    }
+
+    // never allocates; index_reserve must have made room
+    void index_insert(_rbtree_node_base* n)
+    {
+        assert(m_count < m_limit);
+        place(n);
+        ++m_count;
+    }
+
+    void index_erase(_rbtree_node_base* n)
+    {
+        auto const mask = bucket_count() - 1;
+        auto i = slot_of(data(n));
+        while (m_slots[i] != n) {
+            assert(m_slots[i] != nullptr);
+            i = (i + 1) & mask;
+        }
+        // Move later entries of the cluster into the hole unless that would
+        // put them before their home slot.
+        for (auto j = (i + 1) & mask; m_slots[j] != nullptr; j = (j + 1) & mask) {
+            auto const home = slot_of(data(m_slots[j]));
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                m_slots[i] = m_slots[j];
+                i = j;
+            }
+        }
+        m_slots[i] = nullptr;
+        --m_count;
+    }
+
+    void index_clear()
+    {
+        m_slots.reset();
+        m_shift = 64;
+        m_count = 0;
+        m_limit = 0;
+    }
+
+    _rbtree_node_base* index_find(Data const& d) const
+    {
+        if (m_count == 0) return nullptr;
+        auto const mask = bucket_count() - 1;
+        for (auto i = slot_of(d); m_slots[i] != nullptr; i = (i + 1) & mask) {
+            if (m_eq(data(m_slots[i]), d)) return m_slots[i];
+        }
+        return nullptr;
+    }
+
+  private:
+    static const std::size_t min_buckets = 16;
+
+    std::unique_ptr<_rbtree_node_base*[]> m_slots;
+    unsigned m_shift;
+    std::size_t m_count;
+    std::size_t m_limit;
+    float m_max_load;
+    Hash m_hash;
+    KeyEqual m_eq;
+
+    static Data const& data(_rbtree_node_base* n)
+    {
+        return static_cast<_dnode*>(n)->data();
+    }
+
+    std::size_t slot_of(Data const& d) const
+    {
+        return std::size_t((uint64_t(m_hash(d)) * 0x9e3779b97f4a7c15ull) >> m_shift);
+    }
+
+    void place(_rbtree_node_base* n)
+    {
+        auto const mask = bucket_count() - 1;
+        auto i = slot_of(data(n));
+        while (m_slots[i] != nullptr) i = (i + 1) & mask;
+        m_slots[i] = n;
+    }
+
+    void rehash(std::size_t cap)
+    {
+        unsigned bits = 0;
+        while ((std::size_t(1) << bits) < cap) ++bits;
+        while (m_count > std::size_t(float(std::size_t(1) << bits) * m_max_load)) ++bits;
+        std::unique_ptr<_rbtree_node_base*[]> old(new _rbtree_node_base*[std::size_t(1) << bits]());
+        auto const old_cap = bucket_count();
+        m_slots.swap(old);
+        m_shift = 64 - bits;
+        m_limit = std::size_t(float(bucket_count()) * m_max_load);
+        for (std::size_t i = 0; i < old_cap; ++i) {
+            if (old[i]) place(old[i]);
+        }
+    }
+};
+
+// rbtree that also keeps a hash index of its live elements, so contains,
+// find, erase and extract take O(1) expected time instead of a descent.
+// Ordered operations still use the tree. Hash and KeyEqual must agree
+// with Comp: elements equivalent under Comp must be equal and hash alike.
+// Tombstones leave the index as they are made, see lazy_erase.
+template<class Data, class Hash = std::hash<Data>, class KeyEqual = std::equal_to<Data>,
+         class Comp = std::less<Data>, class Alloc = std::allocator<Data>, class Erase = eager_erase>
+class hashed_rbtree : public rbtree<Data, Comp, Alloc, _rbtree_hash_index<Data, Hash, KeyEqual>, rb_balance, Erase>
+{
+    using _index = _rbtree_hash_index<Data, Hash, KeyEqual>;
+  public:
+    // the index holds sizeof(void*) / max_load_factor() bytes per element
+    // once grown; the default of 0.5 costs two words per element
+    float max_load_factor() const
+    {
+        return index().max_load_factor();
+    }
+
+    void max_load_factor(float f)
+    {
+        index().max_load_factor(f);
+    }
+
+    float load_factor() const
+    {
+        return index().load_factor();
+    }
+
+    std::size_t index_bytes() const
+    {
+        return index().index_bytes();
+    }
+
+  private:
+    _index& index()
+    {
+        return *this;
+    }
+
+    _index const& index() const
+    {
+        return *this;
+    }
+};
+
+} // namespace containers
+
+#endif // _RBTREE_HASHED_RBTREE_HPP_
@@ -0,0 +1,79 @@
+/*! rbtree.h */
+
+#ifndef _RBTREE_RBTREE_H_
+#define _RBTREE_RBTREE_H_
+
+#include <rbtree/exports.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C interface to ordered sets of uint64_t keys and of byte-string keys.
+ * Byte strings are ordered like memcmp, shorter first on a common prefix.
+ *
+ * Trees are opaque handles. Besides single key calls, the *_many and
+ * *_range_scan entry points process whole arrays per call, so that
+ * callers crossing an FFI boundary pay for it once per batch.
+ *
+ * Functions returning int use 1/0 for yes/no and -1 for an allocation
+ * failure. Bitmaps hold one bit per key, bit i in byte i/8 at position
+ * i%8, and must have room for (n + 7) / 8 bytes.
+ */
+
+typedef struct rbtree_u64_s rbtree_u64_t;
+typedef struct rbtree_bytes_s rbtree_bytes_t;
+
+/* uint64_t keys */
+
+RBTREE_C_API rbtree_u64_t* rbtree_u64_create(void);
+RBTREE_C_API void rbtree_u64_destroy(rbtree_u64_t* t);
+RBTREE_C_API size_t rbtree_u64_size(rbtree_u64_t const* t);
+RBTREE_C_API void rbtree_u64_clear(rbtree_u64_t* t);
+
+RBTREE_C_API int rbtree_u64_insert(rbtree_u64_t* t, uint64_t key);
+RBTREE_C_API int rbtree_u64_erase(rbtree_u64_t* t, uint64_t key);
+RBTREE_C_API int rbtree_u64_contains(rbtree_u64_t const* t, uint64_t key);
+
+/* inserts keys[0, n); *inserted (if given) receives the number of new keys */
+RBTREE_C_API int rbtree_u64_insert_many(rbtree_u64_t* t, uint64_t const* keys, size_t n, size_t* inserted);
+/* erases keys[0, n) and returns the number of keys removed */
+RBTREE_C_API size_t rbtree_u64_erase_many(rbtree_u64_t* t, uint64_t const* keys, size_t n);
+/* sets bit i of bitmap iff keys[i] is present; returns the number present */
+RBTREE_C_API size_t rbtree_u64_contains_many(rbtree_u64_t const* t, uint64_t const* keys, size_t n, uint8_t* bitmap);
+/* copies up to cap keys in [lo, hi], ascending, to out and returns the
+ * number copied; continue a truncated scan from the last key + 1 */
+RBTREE_C_API size_t rbtree_u64_range_scan(rbtree_u64_t const* t, uint64_t lo, uint64_t hi, uint64_t* out, size_t cap);
+
+/* byte-string keys */
+
+RBTREE_C_API rbtree_bytes_t* rbtree_bytes_create(void);
+RBTREE_C_API void rbtree_bytes_destroy(rbtree_bytes_t* t);
+RBTREE_C_API size_t rbtree_bytes_size(rbtree_bytes_t const* t);
+RBTREE_C_API void rbtree_bytes_clear(rbtree_bytes_t* t);
+
+RBTREE_C_API int rbtree_bytes_insert(rbtree_bytes_t* t, void const* key, size_t len);
+RBTREE_C_API int rbtree_bytes_erase(rbtree_bytes_t* t, void const* key, size_t len);
+RBTREE_C_API int rbtree_bytes_contains(rbtree_bytes_t const* t, void const* key, size_t len);
+
+/* key i is keys[i], lens[i] bytes long. The batch calls below return 0,
+ * or -1 if an allocation failed part way; the count they store (if asked
+ * for) then covers only the keys handled before the failure. */
+RBTREE_C_API int rbtree_bytes_insert_many(rbtree_bytes_t* t, void const* const* keys, size_t const* lens,
+                                          size_t n, size_t* inserted);
+/* *erased receives the number of keys removed */
+RBTREE_C_API int rbtree_bytes_erase_many(rbtree_bytes_t* t, void const* const* keys, size_t const* lens,
+                                         size_t n, size_t* erased);
+/* *found receives the number of keys present; after a failure the bits of
+ * the keys not looked up are clear */
+RBTREE_C_API int rbtree_bytes_contains_many(rbtree_bytes_t const* t, void const* const* keys,
+                                            size_t const* lens, size_t n, uint8_t* bitmap, size_t* found);
+/* copies keys in [lo, hi], ascending, back to back into buf and their
+ * lengths into lens; stops after max_keys keys or when the next key does
+ * not fit in buf_cap bytes. *copied receives the number of keys copied.
+ * A null lo or hi leaves that end of the range open. */
+RBTREE_C_API int rbtree_bytes_range_scan(rbtree_bytes_t const* t, void const* lo, size_t lo_len,
+                                         void const* hi, size_t hi_len, char* buf, size_t buf_cap,
+                                         size_t* lens, size_t max_keys, size_t* copied);
+
+#endif/*_RBTREE_RBTREE_H_*/
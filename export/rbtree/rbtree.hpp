@@ -8,7 +8,12 @@
 #include <iostream>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <string>
+#include <type_traits>
 #include <utility>
 
 namespace containers
@@ -20,6 +25,11 @@ enum _rbnode_color
     _RED = 1
 };
 
+// low bits of m_parent_color; nodes are at least 4 byte aligned
+static const uintptr_t _RBNODE_COLOR_BIT = 1;
+static const uintptr_t _RBNODE_DEAD_BIT = 2;
+static const uintptr_t _RBNODE_TAG_MASK = 3;
+
 struct _rbtree_node_base
 {
     uintptr_t m_parent_color;
@@ -28,24 +38,33 @@ struct _rbtree_node_base
     // access
     _rbnode_color color() const
     {
-        return static_cast<_rbnode_color>(m_parent_color & uintptr_t(1));
+        return static_cast<_rbnode_color>(m_parent_color & _RBNODE_COLOR_BIT);
     }
     _rbtree_node_base* parent() const
     {
-        return (_rbtree_node_base*)(m_parent_color & ~uintptr_t(1));
+        return (_rbtree_node_base*)(m_parent_color & ~_RBNODE_TAG_MASK);
+    }
+    // a dead node is a tombstone: still linked for ordering, but erased
+    bool is_dead() const
+    {
+        return (m_parent_color & _RBNODE_DEAD_BIT) != 0;
     }
     void set_color(_rbnode_color c)
     {
-        auto par_col = m_parent_color & ~uintptr_t(1);
+        auto par_col = m_parent_color & ~_RBNODE_COLOR_BIT;
         par_col |= uintptr_t((c == _RED) ? 1 : 0);
         m_parent_color = par_col;
     }
     void set_parent(_rbtree_node_base* n)
     {
         auto n_int = (uintptr_t)n;
-        n_int |= (m_parent_color & uintptr_t(1));
+        n_int |= (m_parent_color & _RBNODE_TAG_MASK);
         m_parent_color = n_int;
     }
+    void set_dead(bool dead)
+    {
+        m_parent_color = dead ? (m_parent_color | _RBNODE_DEAD_BIT) : (m_parent_color & ~_RBNODE_DEAD_BIT);
+    }
     _rbtree_node_base* right() const
     {
         return m_right;
@@ -118,82 +137,322 @@ struct _rbtree_node : public _rbtree_node_base
     }
 };
 
-class RBTREE_API _rbtree_ops
+// Node that also caches an order-preserving prefix of its key. It derives
+// from _rbtree_node<Data>, so code that only reads data() is unaffected.
+template<class Data>
+struct _rbtree_prefixed_node : public _rbtree_node<Data>
+{
+    uint64_t m_prefix;
+    // access
+    _rbtree_prefixed_node* parent() const
+    {
+        return static_cast<_rbtree_prefixed_node*>(_rbtree_node_base::parent());
+    }
+    _rbtree_prefixed_node* right() const
+    {
+        return static_cast<_rbtree_prefixed_node*>(_rbtree_node_base::right());
+    }
+    _rbtree_prefixed_node* left() const
+    {
+        return static_cast<_rbtree_prefixed_node*>(_rbtree_node_base::left());
+    }
+    _rbtree_prefixed_node* grandparent() const
+    {
+        return static_cast<_rbtree_prefixed_node*>(_rbtree_node_base::grandparent());
+    }
+};
+
+// bytes a node type caches besides its links and its data
+template<class Node>
+struct _rbtree_node_meta
+{
+    static const std::size_t bytes = 0;
+};
+
+template<class Data>
+struct _rbtree_node_meta<_rbtree_prefixed_node<Data>>
+{
+    static const std::size_t bytes = sizeof(uint64_t);
+};
+
+// Key prefixes: make(k) maps a key to an integer such that make(a) < make(b)
+// implies comp(a, b). Equal prefixes decide nothing and fall back to comp.
+// Only enabled for key and comparator pairs known to satisfy this.
+template<class Data, class Comp>
+struct _rbtree_key_prefix
+{
+    static const bool enabled = false;
+};
+
+template<>
+struct _rbtree_key_prefix<std::string, std::less<std::string>>
+{
+    static const bool enabled = true;
+    // first 8 bytes, big endian and zero padded; std::string compares bytes
+    // as unsigned char, so integer order agrees with string order
+    static uint64_t make(std::string const& s)
+    {
+        uint64_t p = 0;
+        auto const d = s.data();
+        auto const n = s.size() < 8 ? s.size() : 8;
+        for (std::size_t i = 0; i < n; ++i) {
+            p |= uint64_t((unsigned char)d[i]) << (56 - 8*i);
+        }
+        return p;
+    }
+};
+
+// Search key bound to a comparator. The prefixed version computes the
+// key's prefix once per operation, and settles most node comparisons on
+// the cached prefixes without reading the node's key.
+template<class Data, class Comp, class Node, bool Prefixed = _rbtree_key_prefix<Data, Comp>::enabled>
+class _rbtree_probe
 {
   public:
-    // diagnostic
-    static bool _verify_rb_alt(_rbtree_node_base* n);
-    static bool _verify_black_ht(_rbtree_node_base* n, size_t& ht);
+    _rbtree_probe(Data const& key, Comp const& comp) : m_key(key), m_comp(comp)
+    { }
+
+    Data const& key() const
+    {
+        return m_key;
+    }
+
+    // key < node
+    bool key_less(Node const* n) const
+    {
+        return m_comp(m_key, n->data());
+    }
+
+    // node < key
+    bool node_less(Node const* n) const
+    {
+        return m_comp(n->data(), m_key);
+    }
+
+    // fills in whatever the node caches about its key
+    static void prepare(Node*)
+    { }
+
+  private:
+    Data const& m_key;
+    Comp const& m_comp;
+};
+
+template<class Data, class Comp, class Node>
+class _rbtree_probe<Data, Comp, Node, true>
+{
+    using _prefix = _rbtree_key_prefix<Data, Comp>;
+  public:
+    _rbtree_probe(Data const& key, Comp const& comp)
+      : m_key(key), m_comp(comp), m_prefix(_prefix::make(key))
+    { }
+
+    Data const& key() const
+    {
+        return m_key;
+    }
+
+    bool key_less(Node const* n) const
+    {
+        if (m_prefix != n->m_prefix) return m_prefix < n->m_prefix;
+        return m_comp(m_key, n->data());
+    }
+
+    bool node_less(Node const* n) const
+    {
+        if (m_prefix != n->m_prefix) return n->m_prefix < m_prefix;
+        return m_comp(n->data(), m_key);
+    }
+
+    static void prepare(Node* n)
+    {
+        n->m_prefix = _prefix::make(n->data());
+    }
+
   private:
+    Data const& m_key;
+    Comp const& m_comp;
+    uint64_t m_prefix;
+};
+
+template<class Data, class Comp>
+using _rbtree_node_for = typename std::conditional<
+    _rbtree_key_prefix<Data, Comp>::enabled, _rbtree_prefixed_node<Data>, _rbtree_node<Data>>::type;
+
+// Link access used by the balancing code. The algorithms in _rbtree_link_ops
+// are written against this interface so that pointer-linked nodes and
+// index-linked nodes (see static_rbtree) share them. A links object names
+// nodes by handle, reads and writes their links and colors, and owns the
+// root slot that rotations may update.
+struct _rbtree_ptr_links
+{
+    using node = _rbtree_node_base*;
+
+    explicit _rbtree_ptr_links(_rbtree_node_base** root = nullptr) : m_root(root)
+    { }
+
+    static node nil()
+    {
+        return nullptr;
+    }
+    void set_root(node n) const
+    {
+        *m_root = n;
+    }
+    static node parent(node n)
+    {
+        return n->parent();
+    }
+    static node left(node n)
+    {
+        return n->left();
+    }
+    static node right(node n)
+    {
+        return n->right();
+    }
+    static _rbnode_color color(node n)
+    {
+        return n->color();
+    }
+    static void set_parent(node n, node p)
+    {
+        n->set_parent(p);
+    }
+    static void set_left(node n, node c)
+    {
+        n->set_left(c);
+    }
+    static void set_right(node n, node c)
+    {
+        n->set_right(c);
+    }
+    static void set_color(node n, _rbnode_color c)
+    {
+        n->set_color(c);
+    }
+    // called once per rotation; a hook for instrumentation
+    static void rotated()
+    { }
+
+    _rbtree_node_base** m_root;
+};
+
+template<class L>
+struct _rbtree_link_ops
+{
+    using node = typename L::node;
+
+    // traversal
+    static node minimum(L const& l, node n)
+    {
+        if (n == L::nil()) return n;
+        while (l.left(n) != L::nil()) n = l.left(n);
+        return n;
+    }
+
+    static node maximum(L const& l, node n)
+    {
+        if (n == L::nil()) return n;
+        while (l.right(n) != L::nil()) n = l.right(n);
+        return n;
+    }
+
+    static node next(L const& l, node n)
+    {
+        assert(n != L::nil());
+        if (l.right(n) != L::nil()) return minimum(l, l.right(n));
+        auto p = l.parent(n);
+        while (p != L::nil() && n == l.right(p)) {
+            n = p;
+            p = l.parent(p);
+        }
+        return p;
+    }
+
+    static node prev(L const& l, node n)
+    {
+        assert(n != L::nil());
+        if (l.left(n) != L::nil()) return maximum(l, l.left(n));
+        auto p = l.parent(n);
+        while (p != L::nil() && n == l.left(p)) {
+            n = p;
+            p = l.parent(p);
+        }
+        return p;
+    }
+
     // tree operations
-    static void rotate_left(_rbtree_node_base* n, _rbtree_node_base** root)
+    static void rotate_left(L const& l, node n)
     {
-        assert(n != nullptr);
-        auto nnew = n->right();
-        assert(nnew != nullptr);
+        assert(n != L::nil());
+        auto nnew = l.right(n);
+        assert(nnew != L::nil());
 
         // rotate
-        n->set_right(nnew->left());
-        nnew->set_left(n);
-        if (n->right()) {
-            n->right()->set_parent(n);
+        l.set_right(n, l.left(nnew));
+        l.set_left(nnew, n);
+        if (l.right(n) != L::nil()) {
+            l.set_parent(l.right(n), n);
         }
 
         // handle parents
-        auto parent = n->parent();
-        if (parent) {
-            if (parent->right() == n) {
-                parent->set_right(nnew);
-            } else {
-                parent->set_left(nnew);
-            }
-        } else {
-            *root = nnew;
-        }
-        nnew->set_parent(parent);
-        n->set_parent(nnew);
+        auto parent = l.parent(n);
+        replace_child(l, parent, n, nnew);
+        l.set_parent(nnew, parent);
+        l.set_parent(n, nnew);
+        l.rotated();
     }
 
-    static void rotate_right(_rbtree_node_base* n, _rbtree_node_base** root)
+    static void rotate_right(L const& l, node n)
     {
-        assert(n != nullptr);
-        auto nnew = n->left();
-        assert(nnew != nullptr);
+        assert(n != L::nil());
+        auto nnew = l.left(n);
+        assert(nnew != L::nil());
 
         // rotate
-        n->set_left(nnew->right());
-        nnew->set_right(n);
-        if (n->left()) {
-            n->left()->set_parent(n);
+        l.set_left(n, l.right(nnew));
+        l.set_right(nnew, n);
+        if (l.left(n) != L::nil()) {
+            l.set_parent(l.left(n), n);
         }
 
         // handle parents
-        auto parent = n->parent();
-        if (parent) {
-            if (parent->right() == n) {
-                parent->set_right(nnew);
-            } else {
-                parent->set_left(nnew);
-            }
+        auto parent = l.parent(n);
+        replace_child(l, parent, n, nnew);
+        l.set_parent(nnew, parent);
+        l.set_parent(n, nnew);
+        l.rotated();
+    }
+
+    static void replace_child(L const& l, node parent, node old_child, node new_child)
+    {
+        if (parent == L::nil()) {
+            l.set_root(new_child);
+        } else if (l.left(parent) == old_child) {
+            l.set_left(parent, new_child);
         } else {
-            *root = nnew;
+            l.set_right(parent, new_child);
         }
-        nnew->set_parent(parent);
-        n->set_parent(nnew);
     }
-  public:
-    static bool insert_rebalance(_rbtree_node_base* node, _rbtree_node_base** root)
+
+    static bool is_black(L const& l, node n)
     {
-        auto parent = node->parent();
-        if (parent == nullptr) {
-            node->set_color(_BLACK);
+        return n == L::nil() || l.color(n) == _BLACK;
+    }
+
+    static bool insert_rebalance(L const& l, node node)
+    {
+        auto parent = l.parent(node);
+        if (parent == L::nil()) {
+            l.set_color(node, _BLACK);
             return false;
         }
-        if (parent->color() == _BLACK) return false;
-        auto grandparent = parent->parent();
-        if (!grandparent) return false;
-        auto uncle = parent->sibling();
-        if (uncle && uncle->color() == _RED) {
+        if (l.color(parent) == _BLACK) return false;
+        auto grandparent = l.parent(parent);
+        if (grandparent == L::nil()) return false;
+        auto uncle = (l.left(grandparent) == parent) ? l.right(grandparent) : l.left(grandparent);
+        if (uncle != L::nil() && l.color(uncle) == _RED) {
             // If both the parent P and the uncle U are _RED, then both of them can be
             // repainted _BLACK and the grandparent G becomes _RED to maintain property:
             // "all paths from any given node to its leaf nodes contain the same number
@@ -202,9 +461,9 @@ class RBTREE_API _rbtree_ops
             // the number of _BLACK nodes on these paths has not changed. However, the grandparent
             // G may now violate property: "the root is _BLACK" if it is the root or property:
             // "both children of every _RED node are _BLACK" if it has a _RED parent.
-            parent->set_color(_BLACK);
-            uncle->set_color(_BLACK);
-            grandparent->set_color(_RED);
+            l.set_color(parent, _BLACK);
+            l.set_color(uncle, _BLACK);
+            l.set_color(grandparent, _RED);
             return true;
         }
         // The parent P is _RED but the uncle U is _BLACK. The ultimate goal will be to rotate the parent
@@ -217,12 +476,12 @@ class RBTREE_API _rbtree_ops
         // "all paths from any given node to its leaf nodes contain the same number of _BLACK nodes" is not
         // violated by the rotation. After this step has been completed, property "both children of every _RED
         // node are _BLACK" is still violated, but now we can resolve this by continuing to step 2.
-        if (grandparent->left() && node == grandparent->left()->right()) {
-            rotate_left(parent, root);
-            node = node->left();
-        } else if (grandparent->right() && node == grandparent->right()->left()) {
-            rotate_right(parent, root);
-            node = node->right();
+        if (parent == l.left(grandparent) && node == l.right(parent)) {
+            rotate_left(l, parent);
+            node = l.left(node);
+        } else if (parent == l.right(grandparent) && node == l.left(parent)) {
+            rotate_right(l, parent);
+            node = l.right(node);
         }
         // The current node N is now certain to be on the "outside" of the subtree under G (left of left child
         // or right of right child). In this case, a right rotation on G is performed; the result is a tree
@@ -232,206 +491,1272 @@ class RBTREE_API _rbtree_ops
         // satisfies that property. Property "all paths from any given node to its leaf nodes contain the same
         // number of _BLACK nodes" also remains satisfied, since all paths that went through any of these three
         // nodes went through G before, and now they all go through P.
-        parent = node->parent();
-        grandparent = node->grandparent();
-        if (!parent || !grandparent) return false;
-        if (node == parent->left()) {
-            rotate_right(grandparent, root);
+        parent = l.parent(node);
+        grandparent = l.parent(parent);
+        if (node == l.left(parent)) {
+            rotate_right(l, grandparent);
         } else {
-            rotate_left(grandparent, root);
+            rotate_left(l, grandparent);
         }
-        parent->set_color(_BLACK);
-        grandparent->set_color(_RED);
+        l.set_color(parent, _BLACK);
+        l.set_color(grandparent, _RED);
         return false;
     }
-};
-
-template<class Data, class Alloc>
-using _rbtree_base_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<_rbtree_node<Data>>;
-
-template<class Data, class Alloc>
-struct _rbtree_base : public _rbtree_base_alloc<Data, Alloc>
-{
-  protected:
-    using _alloc = _rbtree_base_alloc<Data, Alloc>;
-    using _alloc_traits = std::allocator_traits<_alloc>;
-
-    using _node = _rbtree_node<Data>;
-
-    _node* m_root;
-    std::size_t m_size;
 
-  public:
-    void clear()
+    // rebalances after linking the _RED node n
+    static void insert_fixup(L const& l, node n)
     {
-        if (m_root) {
-            remove_nodes_under(m_root);
-            m_root = nullptr;
+        while (n != L::nil() && insert_rebalance(l, n)) {
+            n = l.parent(l.parent(n));
         }
     }
 
-    std::size_t size() const
+    // Unlinks z, moving its successor into its place if z has two children.
+    // On return x is the node that moved up into the position vacated (it
+    // may be nil, hence x_parent), and the color, or rank parity, that the
+    // tree lost there is returned.
+    static _rbnode_color splice(L const& l, node z, node& x, node& x_parent)
     {
-        return m_size;
+        // y is the node whose position is vacated, x the child moving into it
+        auto y = z;
+        x = L::nil();
+        x_parent = L::nil();
+        if (l.left(z) == L::nil()) {
+            x = l.right(z);
+        } else if (l.right(z) == L::nil()) {
+            x = l.left(z);
+        } else {
+            y = minimum(l, l.right(z));
+            x = l.right(y);
+        }
+
+        _rbnode_color removed;
+        if (y != z) {
+            // z has two children: splice its successor y into z's place
+            l.set_parent(l.left(z), y);
+            l.set_left(y, l.left(z));
+            if (y != l.right(z)) {
+                x_parent = l.parent(y);
+                if (x != L::nil()) l.set_parent(x, x_parent);
+                l.set_left(x_parent, x);
+                l.set_right(y, l.right(z));
+                l.set_parent(l.right(z), y);
+            } else {
+                x_parent = y;
+            }
+            replace_child(l, l.parent(z), z, y);
+            l.set_parent(y, l.parent(z));
+            // y takes over z's color, so the color lost is the one y had
+            removed = l.color(y);
+            l.set_color(y, l.color(z));
+        } else {
+            x_parent = l.parent(z);
+            if (x != L::nil()) l.set_parent(x, x_parent);
+            replace_child(l, x_parent, z, x);
+            removed = l.color(z);
+        }
+        return removed;
     }
 
-    bool empty() const
+    // unlinks z and restores the red-black properties; z itself is left for
+    // the caller to release
+    static void erase(L const& l, node z)
     {
-        return m_size == 0;
-    }
+        node x, x_parent;
+        if (splice(l, z, x, x_parent) == _RED) return;
 
-  protected:
-    _rbtree_base() : m_root(nullptr), m_size(0)
-    { }
+        // A _BLACK node was removed, so every path through x is one _BLACK node short.
+        // Push the deficit up the tree, or absorb it with at most three rotations.
+        while (x_parent != L::nil() && is_black(l, x)) {
+            if (x == l.left(x_parent)) {
+                auto w = l.right(x_parent);
+                if (l.color(w) == _RED) {
+                    l.set_color(w, _BLACK);
+                    l.set_color(x_parent, _RED);
+                    rotate_left(l, x_parent);
+                    w = l.right(x_parent);
+                }
+                if (is_black(l, l.left(w)) && is_black(l, l.right(w))) {
+                    l.set_color(w, _RED);
+                    x = x_parent;
+                    x_parent = l.parent(x_parent);
+                } else {
+                    if (is_black(l, l.right(w))) {
+                        l.set_color(l.left(w), _BLACK);
+                        l.set_color(w, _RED);
+                        rotate_right(l, w);
+                        w = l.right(x_parent);
+                    }
+                    l.set_color(w, l.color(x_parent));
+                    l.set_color(x_parent, _BLACK);
+                    if (l.right(w) != L::nil()) l.set_color(l.right(w), _BLACK);
+                    rotate_left(l, x_parent);
+                    return;
+                }
+            } else {
+                auto w = l.left(x_parent);
+                if (l.color(w) == _RED) {
+                    l.set_color(w, _BLACK);
+                    l.set_color(x_parent, _RED);
+                    rotate_right(l, x_parent);
+                    w = l.left(x_parent);
+                }
+                if (is_black(l, l.right(w)) && is_black(l, l.left(w))) {
+                    l.set_color(w, _RED);
+                    x = x_parent;
+                    x_parent = l.parent(x_parent);
+                } else {
+                    if (is_black(l, l.left(w))) {
+                        l.set_color(l.right(w), _BLACK);
+                        l.set_color(w, _RED);
+                        rotate_left(l, w);
+                        w = l.left(x_parent);
+                    }
+                    l.set_color(w, l.color(x_parent));
+                    l.set_color(x_parent, _BLACK);
+                    if (l.left(w) != L::nil()) l.set_color(l.left(w), _BLACK);
+                    rotate_right(l, x_parent);
+                    return;
+                }
+            }
+        }
+        if (x != L::nil()) l.set_color(x, _BLACK);
+    }
+};
 
-    ~_rbtree_base()
-    { clear(); }
+// Rank-balanced trees (AVL and weak AVL) in the framework of Haeupler, Sen
+// and Tarjan. Each node has a rank, and the rank difference between a node
+// and its child is 1 or 2, so one bit of rank parity per node is enough to
+// recover it: a child whose parity differs from its parent's is a 1-child.
+// The parity takes the place of the color bit. A missing child has rank -1,
+// i.e. odd parity, and a new leaf has rank 0. Temporary violations during
+// rebalancing are a 0-child on insert and a 3-child on erase, and each
+// shows up where only one other difference is possible, so parity still
+// tells them apart.
+//
+// AVL allows no 2,2 nodes. Weak AVL allows them everywhere except at
+// leaves, which lets erase stop after at most two rotations.
+template<class L, bool Weak>
+struct _rbtree_rank_ops : _rbtree_link_ops<L>
+{
+    using _ops = _rbtree_link_ops<L>;
+    using node = typename L::node;
 
-    // node creation and deletion
-    _node* _create_node_common()
+    static bool parity(L const& l, node n)
     {
-        auto node = _alloc_traits::allocate(*this, 1);
-        assert((((uintptr_t)node) & 1) == 0);
-        node->m_parent_color = 0;
-        node->m_left = node->m_right = nullptr;
-        return node;
+        return n == L::nil() || l.color(n) == _RED;
     }
 
-    void _destroy_node_common(_node* node)
+    // promotes or demotes n by one
+    static void flip(L const& l, node n)
     {
-        if (!node) return;
-        _alloc_traits::deallocate(*this, node, 1);
+        l.set_color(n, (l.color(n) == _RED) ? _BLACK : _RED);
     }
 
-    _node* _post_create_node(_node* node)
+    // whether c, a child of p or nil, has an odd rank difference
+    static bool odd(L const& l, node p, node c)
     {
-        ++m_size;
-        node->set_color(_RED);
-        node->set_left(nullptr);
-        node->set_right(nullptr);
-        return node;
+        return parity(l, p) != parity(l, c);
     }
 
-    _node* create_node(Data const& d)
+    // rotates at p, lifting its right child if x_left and its left one if not
+    static void rotate_up(L const& l, node p, bool x_left)
     {
-        auto node = _create_node_common();
-        try {
-            ::new (static_cast<void*>(&node->m_data)) Data(d);
-        } catch(...) {
-            _destroy_node_common(node);
-            throw;
+        if (x_left) {
+            _ops::rotate_left(l, p);
+        } else {
+            _ops::rotate_right(l, p);
         }
-        return _post_create_node(node);
     }
 
-    _node* create_node(Data&& d)
+    // rebalances after linking the leaf x
+    static void insert_fixup(L const& l, node x)
     {
-        auto node = _create_node_common();
-        try {
-            ::new (static_cast<void*>(&node->m_data)) Data(std::forward<Data>(d));
-        } catch(...) {
-            _destroy_node_common(node);
-            throw;
+        l.set_color(x, _BLACK);
+        auto p = l.parent(x);
+        // x can only be a 0-child or a 1-child, so equal parity means 0
+        while (p != L::nil() && !odd(l, p, x)) {
+            bool const left = l.left(p) == x;
+            auto const s = left ? l.right(p) : l.left(p);
+            if (odd(l, p, s)) {
+                // p is 0,1: promote it and move up
+                flip(l, p);
+                x = p;
+                p = l.parent(p);
+                continue;
+            }
+            // p is 0,2; y is x's inner child
+            auto const y = left ? l.right(x) : l.left(x);
+            if (y == L::nil() || !odd(l, x, y)) {
+                rotate_up(l, p, !left);
+                flip(l, p);
+            } else {
+                rotate_up(l, x, left);
+                rotate_up(l, p, !left);
+                flip(l, y);
+                flip(l, x);
+                flip(l, p);
+            }
+            return;
         }
-        return _post_create_node(node);
-    }
-
-    void destroy_node(_node* node)
-    {
-        if (!node) return;
-        node->m_data.~Data();
-        --m_size;
-        _destroy_node_common(node);
     }
 
-  private:
-    static void _print_node(_node* n, int lvl)
+    // unlinks z and restores the rank rules; z itself is left for the
+    // caller to release
+    static void erase(L const& l, node z)
     {
-        if (!n) return;
-        for (int i = 0; i < lvl; ++i) {
-            std::cerr << "  ";
+        node x, p;
+        _ops::splice(l, z, x, p);
+        // the node removed had a 1-child or a missing child of rank -1 in x,
+        // so x is now a 2-child or a 3-child of p
+        if (Weak && p != L::nil() && l.left(p) == L::nil() && l.right(p) == L::nil() && parity(l, p)) {
+            // a leaf of rank 1 is a 2,2 leaf
+            flip(l, p);
+            x = p;
+            p = l.parent(p);
         }
-        std::cerr << "|-> (" << (n->color() == _RED ? "r" : "b") << ") " << n->data() << "\n";
-        _print_node(n->left(), lvl + 1);
-        _print_node(n->right(), lvl + 1);
-    }
-  public:
-    void print() const
-    {
-        std::cerr << "\n";
-        _print_node(m_root, 0);
-    }
-
-  protected:
-    void remove_nodes_under(_node* n)
-    {
-        std::unique_ptr<_node*[]> buf(new _node*[m_size]);
-        std::size_t idx = 0;
-        std::size_t end = 1;
-        buf[0] = m_root;
-        while (1) {
-            auto n = buf[idx++];
-            if (n->left() != nullptr) {
-                buf[end++] = n->left();
+        while (p != L::nil()) {
+            bool const left = l.left(p) == x;
+            auto const s = left ? l.right(p) : l.left(p);
+            if (!odd(l, p, x)) {
+                // x is a 2-child: fine unless p is an AVL 2,2 node
+                if (Weak || odd(l, p, s)) return;
+                flip(l, p);
+                x = p;
+                p = l.parent(p);
+                continue;
             }
-            if (n->right() != nullptr) {
-                buf[end++] = n->right();
+            // x is a 3-child
+            if (Weak && !odd(l, p, s)) {
+                // p is 3,2
+                flip(l, p);
+                x = p;
+                p = l.parent(p);
+                continue;
             }
-            if (end >= m_size) {
-                break;
+            // s is a 1-child; v is its inner child, w its outer one
+            auto const v = left ? l.left(s) : l.right(s);
+            auto const w = left ? l.right(s) : l.left(s);
+            if (Weak && !odd(l, s, v) && !odd(l, s, w)) {
+                // s is 2,2
+                flip(l, p);
+                flip(l, s);
+                x = p;
+                p = l.parent(p);
+                continue;
             }
+            if (odd(l, s, w)) {
+                // single rotation at s
+                bool const v_odd = odd(l, s, v);
+                rotate_up(l, p, left);
+                if (Weak) {
+                    flip(l, s);
+                    flip(l, p);
+                    // a leaf must have rank 0
+                    if (l.left(p) == L::nil() && l.right(p) == L::nil()) flip(l, p);
+                    return;
+                }
+                if (v_odd) {
+                    // s rises by one and p drops by one
+                    flip(l, s);
+                    flip(l, p);
+                    return;
+                }
+                // p drops by two; s keeps its rank but is now a level higher
+                x = s;
+                p = l.parent(s);
+                continue;
+            }
+            // double rotation at v: p drops by two, s by one; v rises by two
+            // in a weak AVL tree and by one in an AVL tree
+            rotate_up(l, s, !left);
+            rotate_up(l, p, left);
+            flip(l, s);
+            if (Weak) return;
+            flip(l, v);
+            x = v;
+            p = l.parent(v);
         }
-        idx = 0;
-        auto const sz = m_size;
-        while (idx < sz) {
-            destroy_node(buf[idx++]);
-        }
-    }
-
-    bool verify() const
-    {
-        if (!m_root) return true;
-        bool const rbalt = _rbtree_ops::_verify_rb_alt(m_root);
-        size_t lh = 0, rh = 0;
-        bool lv = _rbtree_ops::_verify_black_ht(m_root->left(), lh);
-        bool rv = _rbtree_ops::_verify_black_ht(m_root->right(), rh);
-        return lv && rv && (lh == rh);
     }
 };
 
-template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>>
-class rbtree : public _rbtree_base<Data, Alloc>
+class RBTREE_API _rbtree_ops
 {
-  private:
-    using _node = typename _rbtree_base<Data, Alloc>::_node;
+    using _links = _rbtree_ptr_links;
+    using _impl = _rbtree_link_ops<_rbtree_ptr_links>;
   public:
-    bool contains(Data const& d) const
+    // diagnostic
+    static bool _verify_rb_alt(_rbtree_node_base* n);
+    static bool _verify_black_ht(_rbtree_node_base* n, size_t& ht);
+    // traversal
+    static _rbtree_node_base* minimum(_rbtree_node_base* n)
     {
-        _node* n;
-        find_lb(d, n);
-        return n != nullptr;
+        return _impl::minimum(_links(), n);
     }
 
-    bool insert(Data&& d)
+    static _rbtree_node_base* maximum(_rbtree_node_base* n)
     {
-        assert(this->verify());
-        _node* n = nullptr;
-        auto p = find_parent(d, n);
-        if (n) return false;
-        n = this->create_node(std::forward<Data>(d));
-        if (!p) {
-            this->m_root = n;
+        return _impl::maximum(_links(), n);
+    }
+
+    static _rbtree_node_base* next(_rbtree_node_base* n)
+    {
+        return _impl::next(_links(), n);
+    }
+
+    static _rbtree_node_base* prev(_rbtree_node_base* n)
+    {
+        return _impl::prev(_links(), n);
+    }
+
+    // first node at or after n that is not a tombstone
+    static _rbtree_node_base* skip_dead(_rbtree_node_base* n)
+    {
+        while (n && n->is_dead()) n = next(n);
+        return n;
+    }
+
+    static _rbtree_node_base* skip_dead_back(_rbtree_node_base* n)
+    {
+        while (n && n->is_dead()) n = prev(n);
+        return n;
+    }
+
+    // links nodes[0, n), given in key order, into a balanced tree in O(n)
+    // and returns its root
+    static _rbtree_node_base* build(_rbtree_node_base** nodes, std::size_t n);
+
+    // tree operations
+    static bool insert_rebalance(_rbtree_node_base* node, _rbtree_node_base** root)
+    {
+        return _impl::insert_rebalance(_links(root), node);
+    }
+
+    // unlinks node from the tree rooted at *root and restores the red-black
+    // properties; the node itself is left for the caller to destroy
+    static void erase(_rbtree_node_base* node, _rbtree_node_base** root);
+
+    // number of _BLACK nodes on a path from n down to a leaf, counting n
+    static std::size_t black_height(_rbtree_node_base* n);
+
+    // Joins the trees rooted at l and r, of black heights lh and rh, around
+    // the node k, where l holds only smaller keys than k and r only larger
+    // ones. Runs in O(|lh - rh| + 1), returns the new root and sets h to its
+    // black height. Red roots of l and r are blackened, and lh and rh are
+    // the heights after that.
+    static _rbtree_node_base* join(_rbtree_node_base* l, std::size_t lh, _rbtree_node_base* k,
+                                   _rbtree_node_base* r, std::size_t rh, std::size_t& h);
+
+    // joins l and r, where every key in l is smaller than every key in r,
+    // in O(log n)
+    static _rbtree_node_base* join(_rbtree_node_base* l, _rbtree_node_base* r);
+
+    // rank-balanced variants, see _rbtree_rank_ops
+    static bool _verify_ranks(_rbtree_node_base* n, bool weak, long& rank);
+    // like build, with rank parities instead of colors
+    static _rbtree_node_base* build_ranked(_rbtree_node_base** nodes, std::size_t n);
+};
+
+// Balancing policies for rbtree. Each one owns the bit in m_parent_color
+// that is the color for red-black trees and the rank parity otherwise, and
+// provides insert_fixup, erase, build and verify over pointer nodes. All of
+// them rebalance with the same rotations. Only red-black trees support
+// join, so erase_range falls back to per-node erase for the others.
+struct rb_balance
+{
+    static const bool joinable = true;
+
+    static void insert_fixup(_rbtree_node_base* n, _rbtree_node_base** root)
+    {
+        while (n && _rbtree_ops::insert_rebalance(n, root)) {
+            n = n->grandparent();
+        }
+    }
+
+    static void erase(_rbtree_node_base* n, _rbtree_node_base** root)
+    {
+        _rbtree_ops::erase(n, root);
+    }
+
+    static _rbtree_node_base* build(_rbtree_node_base** nodes, std::size_t n)
+    {
+        return _rbtree_ops::build(nodes, n);
+    }
+
+    static bool verify(_rbtree_node_base* root)
+    {
+        if (!root) return true;
+        bool const rbalt = _rbtree_ops::_verify_rb_alt(root);
+        size_t lh = 0, rh = 0;
+        bool lv = _rbtree_ops::_verify_black_ht(root->left(), lh);
+        bool rv = _rbtree_ops::_verify_black_ht(root->right(), rh);
+        return rbalt && lv && rv && (lh == rh);
+    }
+};
+
+template<bool Weak>
+struct _rank_balance
+{
+    static const bool joinable = false;
+
+    static void insert_fixup(_rbtree_node_base* n, _rbtree_node_base** root)
+    {
+        _rbtree_rank_ops<_rbtree_ptr_links, Weak>::insert_fixup(_rbtree_ptr_links(root), n);
+    }
+
+    static void erase(_rbtree_node_base* n, _rbtree_node_base** root)
+    {
+        _rbtree_rank_ops<_rbtree_ptr_links, Weak>::erase(_rbtree_ptr_links(root), n);
+    }
+
+    static _rbtree_node_base* build(_rbtree_node_base** nodes, std::size_t n)
+    {
+        return _rbtree_ops::build_ranked(nodes, n);
+    }
+
+    static bool verify(_rbtree_node_base* root)
+    {
+        long rank;
+        return _rbtree_ops::_verify_ranks(root, Weak, rank);
+    }
+};
+
+// AVL: height at most 1.44 log2 n, for lookup-heavy trees
+using avl_balance = _rank_balance<false>;
+// weak AVL: AVL height when there are no erases, never worse than
+// red-black, and at most two rotations per erase
+using wavl_balance = _rank_balance<true>;
+
+// Erase policies. eager_erase unlinks and rebalances on every erase and
+// keeps no state, so it adds nothing to the size of a tree. lazy_erase lets
+// erase leave tombstones instead, see set_max_tombstone_ratio, and holds
+// their count, the node an incremental compaction resumes from, and the
+// ratio that triggers a rebuild.
+struct eager_erase
+{
+    static const bool lazy = false;
+
+    std::size_t dead_count() const
+    {
+        return 0;
+    }
+    void set_dead_count(std::size_t)
+    { }
+    _rbtree_node_base* sweep_node() const
+    {
+        return nullptr;
+    }
+    void set_sweep_node(_rbtree_node_base*)
+    { }
+    float max_dead_ratio() const
+    {
+        return 0;
+    }
+    void set_max_dead_ratio(float)
+    { }
+};
+
+struct lazy_erase
+{
+    static const bool lazy = true;
+
+    lazy_erase() : m_dead(0), m_sweep(nullptr), m_max_dead_ratio(0)
+    { }
+
+    std::size_t dead_count() const
+    {
+        return m_dead;
+    }
+    void set_dead_count(std::size_t n)
+    {
+        m_dead = n;
+    }
+    _rbtree_node_base* sweep_node() const
+    {
+        return m_sweep;
+    }
+    void set_sweep_node(_rbtree_node_base* n)
+    {
+        m_sweep = n;
+    }
+    float max_dead_ratio() const
+    {
+        return m_max_dead_ratio;
+    }
+    void set_max_dead_ratio(float r)
+    {
+        m_max_dead_ratio = r;
+    }
+
+  private:
+    std::size_t m_dead;
+    _rbtree_node_base* m_sweep;
+    float m_max_dead_ratio;
+};
+
+template<class Data, class Comp, class Alloc, class Index, class Balance, class Erase>
+class rbtree;
+
+template<class Data>
+class _rbtree_iterator
+{
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = Data;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Data const*;
+    using reference = Data const&;
+
+    _rbtree_iterator() : m_node(nullptr), m_root(nullptr)
+    { }
+
+    _rbtree_iterator(_rbtree_node_base* n, _rbtree_node_base* const* root)
+      : m_node(n), m_root(root)
+    { }
+
+    reference operator*() const
+    {
+        assert(m_node != nullptr);
+        return static_cast<_rbtree_node<Data>*>(m_node)->data();
+    }
+
+    pointer operator->() const
+    {
+        return &(**this);
+    }
+
+    _rbtree_iterator& operator++()
+    {
+        m_node = _rbtree_ops::skip_dead(_rbtree_ops::next(m_node));
+        return *this;
+    }
+
+    _rbtree_iterator operator++(int)
+    {
+        auto it = *this;
+        ++(*this);
+        return it;
+    }
+
+    _rbtree_iterator& operator--()
+    {
+        // decrementing end() yields the maximum
+        m_node = _rbtree_ops::skip_dead_back(m_node ? _rbtree_ops::prev(m_node) : _rbtree_ops::maximum(*m_root));
+        return *this;
+    }
+
+    _rbtree_iterator operator--(int)
+    {
+        auto it = *this;
+        --(*this);
+        return it;
+    }
+
+    bool operator==(_rbtree_iterator const& o) const
+    {
+        return m_node == o.m_node;
+    }
+
+    bool operator!=(_rbtree_iterator const& o) const
+    {
+        return m_node != o.m_node;
+    }
+
+  private:
+    template<class, class, class, class, class, class>
+    friend class rbtree;
+
+    _rbtree_node_base* m_node;
+    _rbtree_node_base* const* m_root;
+};
+
+// hints that the node at p will be read soon
+inline void _rbtree_prefetch(void const* p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
+// Side index over the live nodes of a tree, for point lookups that bypass
+// the tree. The default keeps none; see hashed_rbtree for one that does.
+struct _rbtree_no_index
+{
+    static const bool enabled = false;
+
+    void index_reserve(std::size_t)
+    { }
+    void index_insert(_rbtree_node_base*)
+    { }
+    void index_erase(_rbtree_node_base*)
+    { }
+    void index_clear()
+    { }
+    template<class D>
+    _rbtree_node_base* index_find(D const&) const
+    {
+        return nullptr;
+    }
+    std::size_t index_bytes() const
+    {
+        return 0;
+    }
+};
+
+// Heap memory owned by an element beyond sizeof(Data), for memory_usage().
+// Specialize it for element types that own memory; the default counts
+// nothing, which keeps memory_usage() O(1).
+template<class Data>
+struct rbtree_payload_size
+{
+    static const bool enabled = false;
+    static std::size_t bytes(Data const&)
+    {
+        return 0;
+    }
+};
+
+template<class Char, class Traits, class A>
+struct rbtree_payload_size<std::basic_string<Char, Traits, A>>
+{
+    static const bool enabled = true;
+    // the buffer, unless the characters are stored inline in the object
+    static std::size_t bytes(std::basic_string<Char, Traits, A> const& s)
+    {
+        auto const p = reinterpret_cast<char const*>(s.data());
+        auto const self = reinterpret_cast<char const*>(&s);
+        std::less<char const*> lt;
+        if (!lt(p, self) && lt(p, self + sizeof(s))) return 0;
+        return (s.capacity() + 1) * sizeof(Char);
+    }
+};
+
+// Slab occupancy, for node allocators that report it through a
+// pool_stats() const member. The numbers are the pool's, so they include
+// whatever else allocates from the same pool.
+struct rbtree_pool_stats
+{
+    std::size_t slabs;
+    std::size_t slab_bytes;
+    // node slots in all slabs, and those handed out
+    std::size_t slots;
+    std::size_t used_slots;
+};
+
+template<class A>
+struct _rbtree_pool_stats_of
+{
+    template<class B>
+    static auto test(int) -> decltype(std::declval<B const&>().pool_stats(), std::true_type());
+    template<class>
+    static std::false_type test(...);
+    static const bool enabled = decltype(test<A>(0))::value;
+};
+
+// What a tree's memory goes to. Node bytes split into data, links (with
+// colors and any cached key prefix) and padding.
+struct rbtree_memory
+{
+    // allocated nodes, tombstones included
+    std::size_t nodes;
+    std::size_t node_bytes;
+    std::size_t data_bytes;
+    std::size_t link_bytes;
+    std::size_t padding_bytes;
+    // heap memory owned by the elements, see rbtree_payload_size
+    std::size_t payload_bytes;
+    // a side index, such as hashed_rbtree's
+    std::size_t index_bytes;
+    // what the node allocator holds: its slab bytes if it reports pool
+    // stats, else node_bytes, as std::allocator does not expose its headers
+    std::size_t allocator_bytes;
+    bool pooled;
+    rbtree_pool_stats pool;
+
+    std::size_t total() const
+    {
+        return allocator_bytes + payload_bytes + index_bytes;
+    }
+
+    // share of the pool's slots that are free, 0 without a pool
+    double fragmentation() const
+    {
+        return (pooled && pool.slots) ? 1.0 - double(pool.used_slots) / double(pool.slots) : 0.0;
+    }
+};
+
+template<class Alloc, class Node>
+using _rbtree_base_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+
+template<class Data, class Alloc, class Node = _rbtree_node<Data>, class Index = _rbtree_no_index,
+         class Balance = rb_balance, class Erase = eager_erase>
+struct _rbtree_base : public _rbtree_base_alloc<Alloc, Node>, protected Index, protected Erase
+{
+  protected:
+    using _alloc = _rbtree_base_alloc<Alloc, Node>;
+    using _alloc_traits = std::allocator_traits<_alloc>;
+    using _index = Index;
+    using _balance = Balance;
+    using _erase = Erase;
+
+    using _node = Node;
+
+    _rbtree_node_base* m_root;
+    // cached extremes, kept across inserts, erases and rebuilds; they are
+    // the only per-tree cost of O(1) front(), back() and begin(), and grow
+    // every tree by two words
+    _rbtree_node_base* m_leftmost;
+    _rbtree_node_base* m_rightmost;
+    std::size_t m_size;
+
+  public:
+    using const_iterator = _rbtree_iterator<Data>;
+    using iterator = const_iterator;
+
+    const_iterator begin() const
+    {
+        return make_iterator(_rbtree_ops::skip_dead(m_leftmost));
+    }
+
+    const_iterator end() const
+    {
+        return make_iterator(nullptr);
+    }
+
+    void clear()
+    {
+        if (m_root) {
+            remove_nodes_under(root());
+            m_root = nullptr;
+        }
+        this->index_clear();
+        m_leftmost = m_rightmost = nullptr;
+        this->set_sweep_node(nullptr);
+    }
+
+    // smallest and largest element in O(1); the tree must not be empty
+    Data const& front() const
+    {
+        assert(m_size > 0);
+        return static_cast<_node*>(_rbtree_ops::skip_dead(m_leftmost))->data();
+    }
+
+    Data const& back() const
+    {
+        assert(m_size > 0);
+        return static_cast<_node*>(_rbtree_ops::skip_dead_back(m_rightmost))->data();
+    }
+
+    // Remove the smallest (largest) element without a search. Unlinking an
+    // extreme node has at most one child to splice, so rebalancing is
+    // amortized O(1). Tombstones passed on the way are unlinked as well.
+    void pop_front()
+    {
+        assert(m_size > 0);
+        while (m_leftmost->is_dead()) {
+            unlink_node(static_cast<_node*>(m_leftmost));
+        }
+        unlink_node(static_cast<_node*>(m_leftmost));
+        assert(verify());
+    }
+
+    void pop_back()
+    {
+        assert(m_size > 0);
+        while (m_rightmost->is_dead()) {
+            unlink_node(static_cast<_node*>(m_rightmost));
+        }
+        unlink_node(static_cast<_node*>(m_rightmost));
+        assert(verify());
+    }
+
+    // Lazy erase, for trees with the lazy_erase policy: with a ratio r > 0,
+    // erase() only marks the node as a tombstone, without rotations. Once
+    // tombstones exceed r times the live size, the tree is compacted with an
+    // O(n) rebuild. A ratio of 0 (the default) erases eagerly.
+    void set_max_tombstone_ratio(float r)
+    {
+        static_assert(Erase::lazy, "set_max_tombstone_ratio needs the lazy_erase policy");
+        assert(r >= 0);
+        this->set_max_dead_ratio(r);
+        maybe_compact();
+    }
+
+    // always 0 with eager_erase
+    std::size_t tombstones() const
+    {
+        return this->dead_count();
+    }
+
+    // O(1), or O(n) when rbtree_payload_size is specialized for Data
+    rbtree_memory memory_usage() const
+    {
+        rbtree_memory m = rbtree_memory();
+        m.nodes = m_size + this->dead_count();
+        m.node_bytes = m.nodes * sizeof(Node);
+        m.data_bytes = m.nodes * sizeof(Data);
+        m.link_bytes = m.nodes * (sizeof(_rbtree_node_base) + _rbtree_node_meta<Node>::bytes);
+        m.padding_bytes = m.node_bytes - m.data_bytes - m.link_bytes;
+        if (rbtree_payload_size<Data>::enabled) {
+            for (auto n = _rbtree_ops::minimum(m_root); n != nullptr; n = _rbtree_ops::next(n)) {
+                m.payload_bytes += rbtree_payload_size<Data>::bytes(static_cast<_node*>(n)->data());
+            }
+        }
+        m.index_bytes = this->index_bytes();
+        m.allocator_bytes = m.node_bytes;
+        pool_usage(m, std::integral_constant<bool, _rbtree_pool_stats_of<_alloc>::enabled>());
+        return m;
+    }
+
+    // drops every tombstone and relinks the live nodes into a balanced tree
+    void compact()
+    {
+        if (this->dead_count() == 0) return;
+        // live nodes fill the buffer from the front in key order, tombstones
+        // from the back; nothing is freed until the walk is done
+        auto const sz = m_size + this->dead_count();
+        std::unique_ptr<_rbtree_node_base*[]> buf(new _rbtree_node_base*[sz]);
+        std::size_t live = 0;
+        std::size_t dead = sz;
+        for (auto n = _rbtree_ops::minimum(m_root); n != nullptr; n = _rbtree_ops::next(n)) {
+            if (n->is_dead()) {
+                buf[--dead] = n;
+            } else {
+                buf[live++] = n;
+            }
+        }
+        assert(live == dead);
+        for (auto i = dead; i < sz; ++i) {
+            destroy_node(static_cast<_node*>(buf[i]));
+        }
+        m_root = Balance::build(buf.get(), live);
+        m_leftmost = live ? buf[0] : nullptr;
+        m_rightmost = live ? buf[live - 1] : nullptr;
+        this->set_sweep_node(nullptr);
+        assert(verify());
+    }
+
+    // Incremental compaction: inspects at most budget nodes, resuming where
+    // the previous call stopped, and unlinks the tombstones among them.
+    // Returns true once a full pass has completed with no tombstones left.
+    // A budget that covers the whole tree gets the O(n) rebuild of
+    // compact() instead. A partial pass cannot rebuild without touching
+    // every node, so it unlinks tombstones one by one, at O(log n) each in
+    // the worst case.
+    bool compact(std::size_t budget)
+    {
+        if (this->dead_count() == 0) {
+            this->set_sweep_node(nullptr);
+            return true;
+        }
+        if (budget >= m_size + this->dead_count()) {
+            compact();
+            return true;
+        }
+        auto n = this->sweep_node() ? this->sweep_node() : _rbtree_ops::minimum(m_root);
+        while (n != nullptr && budget-- > 0) {
+            auto nx = _rbtree_ops::next(n);
+            if (n->is_dead()) {
+                unlink_node(static_cast<_node*>(n));
+            }
+            n = nx;
+        }
+        this->set_sweep_node(n);
+        return this->dead_count() == 0;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+  protected:
+    _rbtree_base() : m_root(nullptr), m_leftmost(nullptr), m_rightmost(nullptr), m_size(0)
+    { }
+
+    ~_rbtree_base()
+    { clear(); }
+
+    const_iterator make_iterator(_rbtree_node_base* n) const
+    {
+        return const_iterator(n, &m_root);
+    }
+
+    _node* root() const
+    {
+        return static_cast<_node*>(m_root);
+    }
+
+    // node creation and deletion
+    _node* _create_node_common()
+    {
+        auto node = _alloc_traits::allocate(*this, 1);
+        assert((((uintptr_t)node) & _RBNODE_TAG_MASK) == 0);
+        node->m_parent_color = 0;
+        node->m_left = node->m_right = nullptr;
+        return node;
+    }
+
+    void _destroy_node_common(_node* node)
+    {
+        if (!node) return;
+        _alloc_traits::deallocate(*this, node, 1);
+    }
+
+    _node* _post_create_node(_node* node)
+    {
+        ++m_size;
+        node->set_color(_RED);
+        node->set_left(nullptr);
+        node->set_right(nullptr);
+        return node;
+    }
+
+    _node* create_node(Data const& d)
+    {
+        auto node = _create_node_common();
+        try {
+            ::new (static_cast<void*>(&node->m_data)) Data(d);
+        } catch(...) {
+            _destroy_node_common(node);
+            throw;
+        }
+        return _post_create_node(node);
+    }
+
+    _node* create_node(Data&& d)
+    {
+        auto node = _create_node_common();
+        try {
+            ::new (static_cast<void*>(&node->m_data)) Data(std::forward<Data>(d));
+        } catch(...) {
+            _destroy_node_common(node);
+            throw;
+        }
+        return _post_create_node(node);
+    }
+
+    void destroy_node(_node* node)
+    {
+        if (!node) return;
+        node->m_data.~Data();
+        if (node->is_dead()) {
+            this->set_dead_count(this->dead_count() - 1);
         } else {
-            n->set_parent(p);
-            if (m_comp(n->data(), p->data())) {
-                p->set_left(n);
+            --m_size;
+        }
+        _destroy_node_common(node);
+    }
+
+    // takes a node that was created by a tree with an equal allocator and
+    // detached from it, keeping its data
+    _node* adopt_node(_node* node)
+    {
+        node->m_parent_color = 0;
+        return _post_create_node(node);
+    }
+
+    // makes room in the side index for one more live node, so that linking
+    // or reviving one cannot fail halfway
+    void reserve_index()
+    {
+        this->index_reserve(m_size + 1);
+    }
+
+    // links a new node below parent (or as the root) and rebalances
+    void link_node(_node* node, _node* parent, bool left)
+    {
+        if (!parent) {
+            m_root = m_leftmost = m_rightmost = node;
+        } else {
+            node->set_parent(parent);
+            if (left) {
+                parent->set_left(node);
+                if (parent == m_leftmost) m_leftmost = node;
             } else {
-                p->set_right(n);
+                parent->set_right(node);
+                if (parent == m_rightmost) m_rightmost = node;
+            }
+        }
+        Balance::insert_fixup(node, &m_root);
+        this->index_insert(node);
+    }
+
+    // removes node from the tree and frees it
+    void unlink_node(_node* node)
+    {
+        detach_node(node);
+        destroy_node(node);
+    }
+
+    // removes node from the tree but leaves it allocated and counted; the
+    // caller either destroys it or hands it off with release_node
+    void detach_node(_node* node)
+    {
+        if (!node->is_dead()) {
+            this->index_erase(node);
+        }
+        if (node == this->sweep_node()) {
+            this->set_sweep_node(_rbtree_ops::next(node));
+        }
+        if (node == m_leftmost) {
+            m_leftmost = _rbtree_ops::next(node);
+        }
+        if (node == m_rightmost) {
+            m_rightmost = _rbtree_ops::prev(node);
+        }
+        Balance::erase(node, &m_root);
+    }
+
+    // frees the detached subtree rooted at n; an incremental compaction
+    // positioned inside it resumes at resume
+    void destroy_subtree(_node* n, _rbtree_node_base* resume)
+    {
+        while (n != nullptr) {
+            destroy_subtree(static_cast<_node*>(n->left()), resume);
+            auto r = static_cast<_node*>(n->right());
+            if (n == this->sweep_node()) this->set_sweep_node(resume);
+            if (!n->is_dead()) this->index_erase(n);
+            destroy_node(n);
+            n = r;
+        }
+    }
+
+    // stops counting a detached live node that now belongs to someone else
+    _node* release_node(_node* node)
+    {
+        assert(!node->is_dead());
+        --m_size;
+        return node;
+    }
+
+    // erases node eagerly, or turns it into a tombstone in lazy mode
+    void erase_node(_node* node)
+    {
+        if (!Erase::lazy || this->max_dead_ratio() <= 0) {
+            unlink_node(node);
+            return;
+        }
+        this->index_erase(node);
+        node->set_dead(true);
+        --m_size;
+        this->set_dead_count(this->dead_count() + 1);
+        maybe_compact();
+    }
+
+    void revive_node(_node* node)
+    {
+        assert(node->is_dead());
+        node->set_dead(false);
+        this->set_dead_count(this->dead_count() - 1);
+        ++m_size;
+        this->index_insert(node);
+    }
+
+    void pool_usage(rbtree_memory&, std::false_type) const
+    { }
+
+    void pool_usage(rbtree_memory& m, std::true_type) const
+    {
+        m.pooled = true;
+        m.pool = static_cast<_alloc const&>(*this).pool_stats();
+        m.allocator_bytes = m.pool.slab_bytes;
+    }
+
+    void maybe_compact()
+    {
+        auto const dead = this->dead_count();
+        if (dead > 0 && float(dead) > this->max_dead_ratio() * float(m_size)) {
+            compact();
+        }
+    }
+
+  private:
+    static void _print_node(_node* n, int lvl)
+    {
+        if (!n) return;
+        for (int i = 0; i < lvl; ++i) {
+            std::cerr << "  ";
+        }
+        std::cerr << "|-> (" << (n->color() == _RED ? "r" : "b") << ") " << n->data() << "\n";
+        _print_node(n->left(), lvl + 1);
+        _print_node(n->right(), lvl + 1);
+    }
+  public:
+    void print() const
+    {
+        std::cerr << "\n";
+        _print_node(root(), 0);
+    }
+
+  protected:
+    void remove_nodes_under(_node* n)
+    {
+        // tombstones are linked too, so they count towards the total
+        auto const sz = m_size + this->dead_count();
+        std::unique_ptr<_node*[]> buf(new _node*[sz]);
+        std::size_t idx = 0;
+        std::size_t end = 1;
+        buf[0] = n;
+        while (end < sz) {
+            auto c = buf[idx++];
+            if (c->left() != nullptr) {
+                buf[end++] = c->left();
+            }
+            if (c->right() != nullptr) {
+                buf[end++] = c->right();
             }
         }
-        while (n && _rbtree_ops::insert_rebalance(n, (_rbtree_node_base**)&this->m_root)) {
-            n = n->grandparent();
+        idx = 0;
+        while (idx < sz) {
+            destroy_node(buf[idx++]);
+        }
+    }
+
+    bool verify() const
+    {
+        if (m_leftmost != _rbtree_ops::minimum(m_root)) return false;
+        if (m_rightmost != _rbtree_ops::maximum(m_root)) return false;
+        return Balance::verify(m_root);
+    }
+};
+
+// Owning handle to a node extracted from an rbtree. The node keeps its
+// storage while detached, so moving it into another tree of the same type
+// allocates nothing, and its value may be changed in between.
+template<class Data, class Node, class NodeAlloc>
+class _rbtree_node_handle : private NodeAlloc
+{
+    using _alloc_traits = std::allocator_traits<NodeAlloc>;
+  public:
+    using value_type = Data;
+    using allocator_type = NodeAlloc;
+
+    _rbtree_node_handle() : m_node(nullptr)
+    { }
+
+    _rbtree_node_handle(_rbtree_node_handle&& o) : NodeAlloc(std::move(o.alloc())), m_node(o.m_node)
+    {
+        o.m_node = nullptr;
+    }
+
+    _rbtree_node_handle& operator=(_rbtree_node_handle&& o)
+    {
+        if (this != &o) {
+            reset();
+            alloc() = std::move(o.alloc());
+            m_node = o.m_node;
+            o.m_node = nullptr;
+        }
+        return *this;
+    }
+
+    ~_rbtree_node_handle()
+    { reset(); }
+
+    bool empty() const
+    {
+        return m_node == nullptr;
+    }
+
+    explicit operator bool() const
+    {
+        return m_node != nullptr;
+    }
+
+    // the handle must not be empty
+    Data& value() const
+    {
+        assert(m_node);
+        return m_node->m_data;
+    }
+
+    allocator_type get_allocator() const
+    {
+        return alloc();
+    }
+
+  private:
+    template<class, class, class, class, class, class>
+    friend class rbtree;
+
+    Node* m_node;
+
+    _rbtree_node_handle(Node* n, NodeAlloc const& a) : NodeAlloc(a), m_node(n)
+    { }
+
+    NodeAlloc& alloc()
+    {
+        return *this;
+    }
+
+    NodeAlloc const& alloc() const
+    {
+        return *this;
+    }
+
+    Node* release()
+    {
+        auto n = m_node;
+        m_node = nullptr;
+        return n;
+    }
+
+    void reset()
+    {
+        if (!m_node) return;
+        m_node->m_data.~Data();
+        _alloc_traits::deallocate(alloc(), m_node, 1);
+        m_node = nullptr;
+    }
+};
+
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>,
+         class Index = _rbtree_no_index, class Balance = rb_balance, class Erase = eager_erase>
+class rbtree : public _rbtree_base<Data, Alloc, _rbtree_node_for<Data, Comp>, Index, Balance, Erase>
+{
+  private:
+    using _base = _rbtree_base<Data, Alloc, _rbtree_node_for<Data, Comp>, Index, Balance, Erase>;
+    using _node = typename _base::_node;
+    using _probe = _rbtree_probe<Data, Comp, _node>;
+    using _alloc = typename _base::_alloc;
+  public:
+    using const_iterator = typename _base::const_iterator;
+    using node_type = _rbtree_node_handle<Data, _node, _alloc>;
+
+    bool contains(Data const& d) const
+    {
+        return find_live(d) != nullptr;
+    }
+
+    const_iterator find(Data const& d) const
+    {
+        return this->make_iterator(find_live(d));
+    }
+
+    bool insert(Data&& d)
+    {
+        assert(this->verify());
+        _node* n = nullptr;
+        bool left = false;
+        auto p = find_parent(probe(d), n, left);
+        if (n && !n->is_dead()) return false;
+        this->reserve_index();
+        if (n) {
+            n->m_data = std::forward<Data>(d);
+            this->revive_node(n);
+            return true;
         }
+        n = this->create_node(std::forward<Data>(d));
+        _probe::prepare(n);
+        this->link_node(n, p, left);
         assert(this->verify());
         return true;
     }
@@ -440,85 +1765,572 @@ class rbtree : public _rbtree_base<Data, Alloc>
     {
         assert(this->verify());
         _node* n = nullptr;
-        auto p = find_parent(d, n);
-        if (n) return false;
+        bool left = false;
+        auto p = find_parent(probe(d), n, left);
+        if (n && !n->is_dead()) return false;
+        this->reserve_index();
+        if (n) {
+            n->m_data = d;
+            this->revive_node(n);
+            return true;
+        }
         n = this->create_node(d);
-        if (!p) {
-            this->m_root = n;
-        } else {
-            n->set_parent(p);
-            if (m_comp(d, p->data())) {
-                p->set_left(n);
+        _probe::prepare(n);
+        this->link_node(n, p, left);
+        assert(this->verify());
+        return true;
+    }
+
+    // Inserts d given hint, the first element not less than d (or end()).
+    // When the hint is right, d is linked next to it without a search,
+    // in O(1) amortized time plus rebalancing; a wrong hint costs two
+    // comparisons on top of a plain insert.
+    bool insert(const_iterator hint, Data&& d)
+    {
+        return insert_hint(hint, std::move(d));
+    }
+
+    bool insert(const_iterator hint, Data const& d)
+    {
+        return insert_hint(hint, d);
+    }
+
+    bool erase(Data const& d)
+    {
+        auto n = find_live(d);
+        if (!n) return false;
+        this->erase_node(n);
+        assert(this->verify());
+        return true;
+    }
+
+    // Unlinks the element equal to d and returns it as a node handle, or an
+    // empty handle if there is none. Nothing is freed.
+    node_type extract(Data const& d)
+    {
+        auto n = find_live(d);
+        if (!n) return node_type();
+        this->detach_node(n);
+        assert(this->verify());
+        return node_type(this->release_node(n), *this);
+    }
+
+    // Links the node held by nh, which must come from a tree with an equal
+    // allocator, without allocating. On success nh is left empty; if an
+    // equal element is already present, returns false and nh keeps the node.
+    bool insert(node_type&& nh)
+    {
+        if (nh.empty()) return false;
+        assert(nh.get_allocator() == static_cast<_alloc const&>(*this));
+        assert(this->verify());
+        auto& d = nh.value();
+        _node* n = nullptr;
+        bool left = false;
+        auto p = find_parent(probe(d), n, left);
+        if (n && !n->is_dead()) return false;
+        this->reserve_index();
+        if (n) {
+            // reuse the tombstone; the handle's node is freed with it
+            n->m_data = std::move(d);
+            this->revive_node(n);
+            nh = node_type();
+            return true;
+        }
+        n = this->adopt_node(nh.release());
+        // the key may have changed while detached
+        _probe::prepare(n);
+        this->link_node(n, p, left);
+        assert(this->verify());
+        return true;
+    }
+
+    // Moves every element into a new node, allocating them in key order,
+    // frees the old nodes and tombstones, and relinks the new ones through
+    // the same rebuild as compact(). An allocator that serves consecutive
+    // requests from fresh memory, as a pool with empty slabs does, then
+    // holds the tree contiguously in order, which restores locality after
+    // heavy churn. All nodes are allocated before any is freed; if that or
+    // copying an element throws, the tree is unchanged.
+    void shrink_to_fit()
+    {
+        auto const n = this->m_size;
+        auto const all = n + this->dead_count();
+        if (all == 0) return;
+        std::unique_ptr<_rbtree_node_base*[]> old(new _rbtree_node_base*[all]);
+        std::unique_ptr<_rbtree_node_base*[]> fresh(new _rbtree_node_base*[n]);
+        // live nodes first, in order, then tombstones
+        std::size_t live = 0;
+        std::size_t dead = all;
+        for (auto p = _rbtree_ops::minimum(this->m_root); p != nullptr; p = _rbtree_ops::next(p)) {
+            old[p->is_dead() ? --dead : live++] = p;
+        }
+        std::size_t i = 0;
+        try {
+            for (; i < n; ++i) {
+                fresh[i] = this->_create_node_common();
+            }
+        } catch (...) {
+            while (i > 0) {
+                this->_destroy_node_common(static_cast<_node*>(fresh[--i]));
+            }
+            throw;
+        }
+        // elements move unless that may throw; then they are copied and
+        // the old ones stay intact until every copy succeeded
+        for (i = 0; i < n; ++i) {
+            auto const o = static_cast<_node*>(old[i]);
+            auto const f = static_cast<_node*>(fresh[i]);
+            this->index_erase(o);
+            try {
+                ::new (static_cast<void*>(&f->m_data)) Data(std::move_if_noexcept(o->m_data));
+            } catch (...) {
+                this->index_insert(o);
+                unwind_fresh(old.get(), fresh.get(), i, n);
+                throw;
+            }
+            _probe::prepare(f);
+            this->index_insert(f);
+        }
+        for (i = 0; i < all; ++i) {
+            auto const o = static_cast<_node*>(old[i]);
+            o->m_data.~Data();
+            this->_destroy_node_common(o);
+        }
+        this->set_dead_count(0);
+        this->m_root = Balance::build(fresh.get(), n);
+        this->m_leftmost = n ? fresh[0] : nullptr;
+        this->m_rightmost = n ? fresh[n - 1] : nullptr;
+        this->set_sweep_node(nullptr);
+        assert(this->verify());
+    }
+
+    // Erases every element in [lo, hi) and returns how many were live. The
+    // range is cut out with two splits and the rest rejoined in O(log n);
+    // freeing the k removed nodes then takes O(k). Balancing policies that
+    // cannot join unlink the k nodes one by one instead.
+    std::size_t erase_range(Data const& lo, Data const& hi)
+    {
+        if (!this->m_root || !m_comp(lo, hi)) return 0;
+        auto const before = this->m_size;
+        if (!Balance::joinable) {
+            _node* eq;
+            auto const h = probe(hi);
+            for (auto n = find_lb(probe(lo), eq); n && h.node_less(n);) {
+                auto const nx = static_cast<_node*>(_rbtree_ops::next(n));
+                this->unlink_node(n);
+                n = nx;
+            }
+            assert(this->verify());
+            return before - this->m_size;
+        }
+        _rbtree_node_base *l, *m, *r;
+        std::size_t lh, mh, rh;
+        split(this->root(), _rbtree_ops::black_height(this->m_root), probe(lo), l, lh, m, mh);
+        split(static_cast<_node*>(m), mh, probe(hi), m, mh, r, rh);
+        auto const resume = _rbtree_ops::minimum(r);
+        this->m_root = _rbtree_ops::join(l, r);
+        this->m_leftmost = _rbtree_ops::minimum(this->m_root);
+        this->m_rightmost = _rbtree_ops::maximum(this->m_root);
+        this->destroy_subtree(static_cast<_node*>(m), resume);
+        assert(this->verify());
+        return before - this->m_size;
+    }
+
+    // Erases the keys in [first, last), which must be sorted in ascending
+    // order, and returns how many were present. Each search starts from
+    // where the previous one ended rather than from the root, so runs of
+    // nearby keys cost less than separate erase calls.
+    template<class It>
+    std::size_t erase_batch(It first, It last)
+    {
+        std::size_t cnt = 0;
+        // first live node after the previous key
+        _node* hint = nullptr;
+        for (bool started = false; first != last; ++first) {
+            // the probe keeps a reference, so a key converted to Data has
+            // to outlive it
+            Data const& k = *first;
+            auto const x = probe(k);
+            _node* lb;
+            if (!started) {
+                _node* eq;
+                lb = find_lb(x, eq);
+                started = true;
+            } else if (!hint) {
+                // nothing live is left at or after the remaining keys
+                break;
+            } else if (x.key_less(hint)) {
+                // x falls between the previous key and hint: absent
+                continue;
             } else {
-                p->set_right(n);
+                lb = x.node_less(hint) ? find_lb_from(hint, x) : hint;
+            }
+            if (!lb) break;
+            bool const found = !lb->is_dead() && !x.key_less(lb);
+            hint = static_cast<_node*>(_rbtree_ops::skip_dead(found ? _rbtree_ops::next(lb) : lb));
+            if (found) {
+                // hint is live, so neither unlinking nor a compaction frees it
+                this->erase_node(lb);
+                ++cnt;
             }
         }
-        while (n && _rbtree_ops::insert_rebalance(n, (_rbtree_node_base**)&this->m_root)) {
-            n = n->grandparent();
+        assert(this->verify());
+        return cnt;
+    }
+
+    // Inserts the keys in [first, last), which must be sorted in ascending
+    // order, and returns how many were new. The searches for a group of
+    // keys run interleaved, prefetching the next node of each, so that
+    // their cache misses overlap instead of following one another; the
+    // keys are then linked in order next to the nodes found, which stay
+    // exact hints because everything linked before a key is smaller.
+    // Keys are moved from when It dereferences to an rvalue, and keys of
+    // another type are converted to Data one at a time.
+    template<class It>
+    std::size_t insert_batch(It first, It last)
+    {
+        std::size_t done;
+        return insert_batch(first, last, done);
+    }
+
+    // as above; done counts the keys handled so far, whether linked or
+    // already present, so that if an insert throws, the keys from position
+    // done on are known to be untouched
+    template<class It>
+    std::size_t insert_batch(It first, It last, std::size_t& done)
+    {
+        // a reference to the key when it is a Data, a converted copy otherwise
+        using ref = decltype(*first);
+        using key = typename std::conditional<
+            std::is_same<typename std::decay<ref>::type, Data>::value, ref, Data>::type;
+        std::size_t cnt = 0;
+        done = 0;
+        It keys[_batch_group];
+        _node* lb[_batch_group];
+        while (first != last) {
+            std::size_t g = 0;
+            for (; g < _batch_group && first != last; ++first) {
+                keys[g++] = first;
+            }
+            find_lbs(keys, g, lb);
+            for (std::size_t i = 0; i < g; ++i) {
+                key d = *keys[i];
+                auto const h = lb[i];
+                if (h && !m_comp(d, h->data())) {
+                    // present, or a tombstone to revive
+                    if (h->is_dead()) {
+                        this->reserve_index();
+                        h->m_data = std::forward<key>(d);
+                        this->revive_node(h);
+                        ++cnt;
+                    }
+                } else {
+                    cnt += insert_hint(this->make_iterator(h), std::forward<key>(d));
+                }
+                ++done;
+            }
         }
         assert(this->verify());
-        return true;
+        return cnt;
+    }
+
+    // range queries
+
+    const_iterator lower_bound(Data const& x) const
+    {
+        _node* n;
+        return this->make_iterator(_rbtree_ops::skip_dead(find_lb(probe(x), n)));
+    }
+
+    const_iterator upper_bound(Data const& x) const
+    {
+        return this->make_iterator(_rbtree_ops::skip_dead(find_ub(probe(x))));
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(Data const& x) const
+    {
+        _node* n;
+        auto lb = _rbtree_ops::skip_dead(find_lb(probe(x), n));
+        // keys are unique, so the range holds at most one element
+        auto ub = (n && lb == n) ? _rbtree_ops::skip_dead(_rbtree_ops::next(n)) : lb;
+        return std::make_pair(this->make_iterator(lb), this->make_iterator(ub));
+    }
+
+    // calls fn(data) in order for every element in [lo, hi)
+    template<class Fn>
+    void for_each_in_range(Data const& lo, Data const& hi, Fn fn) const
+    {
+        auto const plo = probe(lo);
+        auto const phi = probe(hi);
+        _node* n = this->root();
+        while (n != nullptr) {
+            if (plo.node_less(n)) {
+                n = n->right();
+            } else if (!phi.node_less(n)) {
+                n = n->left();
+            } else {
+                // n splits the range: its left subtree is bounded by hi and
+                // its right subtree by lo, so each side needs one check
+                visit_ge(n->left(), plo, fn);
+                if (!n->is_dead()) fn(n->data());
+                visit_lt(n->right(), phi, fn);
+                return;
+            }
+        }
     }
 
   private:
     Comp m_comp;
 
-    bool is_equal(Data const& a, Data const& b) const
+    _probe probe(Data const& x) const
+    {
+        return _probe(x, m_comp);
+    }
+
+    template<class Fn>
+    static void visit_all(_node* n, Fn& fn)
+    {
+        while (n != nullptr) {
+            visit_all(n->left(), fn);
+            if (!n->is_dead()) fn(n->data());
+            n = n->right();
+        }
+    }
+
+    template<class Fn>
+    static void visit_ge(_node* n, _probe const& lo, Fn& fn)
+    {
+        while (n != nullptr) {
+            if (lo.node_less(n)) {
+                n = n->right();
+            } else {
+                visit_ge(n->left(), lo, fn);
+                if (!n->is_dead()) fn(n->data());
+                visit_all(n->right(), fn);
+                return;
+            }
+        }
+    }
+
+    template<class Fn>
+    static void visit_lt(_node* n, _probe const& hi, Fn& fn)
+    {
+        while (n != nullptr) {
+            if (!hi.node_less(n)) {
+                n = n->left();
+            } else {
+                visit_all(n->left(), fn);
+                if (!n->is_dead()) fn(n->data());
+                n = n->right();
+            }
+        }
+    }
+
+    // D must be Data itself: the probe keeps a reference to d
+    template<class D>
+    bool insert_hint(const_iterator hint, D&& d)
+    {
+        static_assert(std::is_same<typename std::decay<D>::type, Data>::value, "insert_hint takes a Data");
+        auto const x = probe(d);
+        auto const h = static_cast<_node*>(hint.m_node);
+        auto const pr = static_cast<_node*>(h ? _rbtree_ops::prev(h) : this->m_rightmost);
+        // x must fall strictly between the hint and the node before it
+        if ((!h && !pr) || (h && !x.key_less(h)) || (pr && !x.node_less(pr))) {
+            return insert(std::forward<D>(d));
+        }
+        assert(this->verify());
+        this->reserve_index();
+        auto n = this->create_node(std::forward<D>(d));
+        _probe::prepare(n);
+        // of two nodes adjacent in order, one has a free slot facing the other
+        if (h && !h->left()) {
+            this->link_node(n, h, true);
+        } else {
+            this->link_node(n, pr, false);
+        }
+        assert(this->verify());
+        return true;
+    }
+
+    static const std::size_t _batch_group = 16;
+
+    // undoes shrink_to_fit once copying the element old[done] failed: the
+    // index gets the old nodes back and all n fresh nodes are freed
+    void unwind_fresh(_rbtree_node_base** old, _rbtree_node_base** fresh, std::size_t done, std::size_t n)
     {
-        return !m_comp(a, b) && !m_comp(b, a);
+        for (std::size_t i = 0; i < n; ++i) {
+            auto const f = static_cast<_node*>(fresh[i]);
+            if (i < done) {
+                this->index_erase(f);
+                this->index_insert(old[i]);
+                f->m_data.~Data();
+            }
+            this->_destroy_node_common(f);
+        }
+    }
+
+    // lb[i] is set to the first node, dead or alive, not less than *keys[i]
+    template<class It>
+    void find_lbs(It const* keys, std::size_t g, _node** lb) const
+    {
+        _node* cur[_batch_group];
+        for (std::size_t i = 0; i < g; ++i) {
+            cur[i] = this->root();
+            lb[i] = nullptr;
+        }
+        for (std::size_t live = g; live > 0;) {
+            live = 0;
+            for (std::size_t i = 0; i < g; ++i) {
+                auto n = cur[i];
+                if (!n) continue;
+                if (!m_comp(n->data(), *keys[i])) {
+                    lb[i] = n;
+                    n = static_cast<_node*>(n->left());
+                } else {
+                    n = static_cast<_node*>(n->right());
+                }
+                cur[i] = n;
+                if (n) {
+                    _rbtree_prefetch(n);
+                    ++live;
+                }
+            }
+        }
     }
 
-    _node* find_lb(Data const& x, _node*& next) const
+    // the live node equal to d, if any; asks the side index when there is one
+    _node* find_live(Data const& d) const
+    {
+        if (Index::enabled) return static_cast<_node*>(this->index_find(d));
+        _node* n;
+        find_lb(probe(d), n);
+        return (n && !n->is_dead()) ? n : nullptr;
+    }
+
+    _node* find_lb(_probe const& x, _node*& next) const
     {
         _node* p = nullptr;
-        _node* n = this->m_root;
+        _node* n = this->root();
         while (n != nullptr) {
-            if (!this->m_comp(n->data(), x)) {
+            if (!x.node_less(n)) {
                 p = n;
                 n = n->left();
             } else {
                 n = n->right();
             }
         }
-        next = (p == nullptr) ? nullptr : this->m_comp(x, p->data()) ? nullptr : p;
+        next = (p == nullptr) ? nullptr : x.key_less(p) ? nullptr : p;
         return p;
     }
 
-    _node* find_parent(Data const& x, _node*& next) const
+    // lower bound of x, given a node f ordered before x: climbs from f to
+    // the lowest ancestor whose subtree must hold the answer, then descends
+    _node* find_lb_from(_node* f, _probe const& x) const
     {
-        _node* p = nullptr;
-        _node* n = this->m_root;
-        bool lt = true;
-        while (n != nullptr) {
-            p = n;
-            lt = this->m_comp(x, n->data());
-            n = lt ? n->left() : n->right();
+        _rbtree_node_base* n = f;
+        _node* lb = nullptr;
+        for (auto p = n->parent(); p != nullptr; n = p, p = p->parent()) {
+            if (p->left() == n && !x.node_less(static_cast<_node*>(p))) {
+                lb = static_cast<_node*>(p);
+                break;
+            }
         }
-        if (lt) {
-            if (p != nullptr && p->parent() != nullptr && this->is_equal(p->parent()->data(), x)) {
-                p = p->grandparent();
+        auto c = static_cast<_node*>(n);
+        while (c != nullptr) {
+            if (!x.node_less(c)) {
+                lb = c;
+                c = static_cast<_node*>(c->left());
+            } else {
+                c = static_cast<_node*>(c->right());
             }
         }
-        if (p && this->is_equal(p->data(), x)) {
-            p = p->parent();
+        return lb;
+    }
+
+    // Splits the subtree t, of black height h as it stands, into the nodes
+    // ordered before x (l) and the rest (r), with their black heights. t's
+    // nodes are relinked; each level joins one side in time proportional to
+    // the difference in black heights, which adds up to O(log n).
+    void split(_node* t, std::size_t h, _probe const& x, _rbtree_node_base*& l, std::size_t& lh,
+               _rbtree_node_base*& r, std::size_t& rh)
+    {
+        if (t == nullptr) {
+            l = r = nullptr;
+            lh = rh = 0;
+            return;
         }
-        if (!p) {
-            if (this->m_root) {
-                next = this->is_equal(this->m_root->data(), x) ? this->m_root : nullptr;
-            }
+        // the child kept whole becomes a standalone tree, and join blackens
+        // its root if it is _RED
+        auto const ch = h - (t->color() == _BLACK);
+        auto const tl = t->left();
+        auto const tr = t->right();
+        auto const tlh = ch + (tl && tl->color() == _RED);
+        auto const trh = ch + (tr && tr->color() == _RED);
+        _rbtree_node_base *a, *b;
+        std::size_t ah, bh;
+        if (x.node_less(t)) {
+            split(static_cast<_node*>(tr), ch, x, a, ah, b, bh);
+            l = _rbtree_ops::join(tl, tlh, t, a, ah, lh);
+            r = b;
+            rh = bh;
         } else {
-            if (p->left()  && this->is_equal(p->left()->data(), x)) {
-                next = p->left();
-            } else if (p->right() && this->is_equal(p->right()->data(), x)) {
-                next = p->right();
+            split(static_cast<_node*>(tl), ch, x, a, ah, b, bh);
+            l = a;
+            lh = ah;
+            r = _rbtree_ops::join(b, bh, t, tr, trh, rh);
+        }
+    }
+
+    _node* find_ub(_probe const& x) const
+    {
+        _node* p = nullptr;
+        _node* n = this->root();
+        while (n != nullptr) {
+            if (x.key_less(n)) {
+                p = n;
+                n = n->left();
+            } else {
+                n = n->right();
+            }
+        }
+        return p;
+    }
+
+    // returns the parent for a new node holding x and whether it goes on the
+    // parent's left; next is set to the node equal to x, if any
+    _node* find_parent(_probe const& x, _node*& next, bool& left) const
+    {
+        // one comparison per level: the last node not greater than x is the
+        // only node that can be equal to it
+        _node* p = nullptr;
+        _node* cand = nullptr;
+        _node* n = this->root();
+        while (n != nullptr) {
+            p = n;
+            left = x.key_less(n);
+            if (left) {
+                n = n->left();
             } else {
-                next = nullptr;
+                cand = n;
+                n = n->right();
             }
         }
+        next = (cand != nullptr && !x.node_less(cand)) ? cand : nullptr;
         return p;
     }
 };
 
+// the same container balanced as an AVL or a weak AVL tree
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>>
+using avl_tree = rbtree<Data, Comp, Alloc, _rbtree_no_index, avl_balance>;
+
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>>
+using wavl_tree = rbtree<Data, Comp, Alloc, _rbtree_no_index, wavl_balance>;
+
+// the same container with lazy erase, see set_max_tombstone_ratio
+template<class Data, class Comp = std::less<Data>, class Alloc = std::allocator<Data>, class Balance = rb_balance>
+using lazy_rbtree = rbtree<Data, Comp, Alloc, _rbtree_no_index, Balance, lazy_erase>;
+
 } // namespace containers
 
 #endif // _RBTREE_RBTREE_HPP_
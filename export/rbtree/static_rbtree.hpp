@@ -0,0 +1,425 @@
+/*! static_rbtree.hpp */
+
+#ifndef _RBTREE_STATIC_RBTREE_HPP_
+#define _RBTREE_STATIC_RBTREE_HPP_
+
+#include <rbtree/rbtree.hpp>
+
+#include <climits>
+#include <stdexcept>
+
+namespace containers
+{
+
+// smallest unsigned type whose values, less the color bit, can name N slots
+// plus a nil index
+template<std::size_t N>
+using _rbtree_index_t = typename std::conditional<(N < 0x7f), uint8_t,
+                        typename std::conditional<(N < 0x7fff), uint16_t, uint32_t>::type>::type;
+
+// Node linked by array index. The color lives in the top bit of the parent
+// index, the same way pointer nodes keep it in the low bit of the parent.
+template<class Data, class Index>
+struct _rbtree_index_node
+{
+    typename std::aligned_storage<sizeof(Data), alignof(Data)>::type m_storage;
+    Index m_parent_color;
+    Index m_left;
+    Index m_right;
+    // access
+    Data& data()
+    {
+        return *reinterpret_cast<Data*>(&m_storage);
+    }
+    Data const& data() const
+    {
+        return *reinterpret_cast<Data const*>(&m_storage);
+    }
+};
+
+// links over an array of index nodes, for _rbtree_link_ops
+template<class Node, class Index>
+struct _rbtree_index_links
+{
+    using node = Index;
+
+    constexpr _rbtree_index_links(Node* nodes, Index* root) : m_nodes(nodes), m_root(root)
+    { }
+
+    static constexpr Index color_bit()
+    {
+        return Index(Index(1) << (sizeof(Index) * CHAR_BIT - 1));
+    }
+    static constexpr node nil()
+    {
+        return Index(color_bit() - 1);
+    }
+    void set_root(node n) const
+    {
+        *m_root = n;
+    }
+    node parent(node n) const
+    {
+        return Index(m_nodes[n].m_parent_color & ~color_bit());
+    }
+    node left(node n) const
+    {
+        return m_nodes[n].m_left;
+    }
+    node right(node n) const
+    {
+        return m_nodes[n].m_right;
+    }
+    _rbnode_color color(node n) const
+    {
+        return (m_nodes[n].m_parent_color & color_bit()) ? _RED : _BLACK;
+    }
+    void set_parent(node n, node p) const
+    {
+        auto& pc = m_nodes[n].m_parent_color;
+        pc = Index((pc & color_bit()) | p);
+    }
+    void set_left(node n, node c) const
+    {
+        m_nodes[n].m_left = c;
+    }
+    void set_right(node n, node c) const
+    {
+        m_nodes[n].m_right = c;
+    }
+    void set_color(node n, _rbnode_color c) const
+    {
+        auto& pc = m_nodes[n].m_parent_color;
+        pc = Index((c == _RED) ? (pc | color_bit()) : (pc & ~color_bit()));
+    }
+    void rotated() const
+    { }
+
+    Node* m_nodes;
+    Index* m_root;
+};
+
+template<class Data, class Index>
+class _static_rbtree_iterator
+{
+    using _node = _rbtree_index_node<Data, Index>;
+    using _links = _rbtree_index_links<_node, Index>;
+    using _ops = _rbtree_link_ops<_links>;
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = Data;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Data const*;
+    using reference = Data const&;
+
+    _static_rbtree_iterator() : m_links(nullptr, nullptr), m_i(_links::nil())
+    { }
+
+    _static_rbtree_iterator(_links l, Index i) : m_links(l), m_i(i)
+    { }
+
+    reference operator*() const
+    {
+        assert(m_i != _links::nil());
+        return m_links.m_nodes[m_i].data();
+    }
+
+    pointer operator->() const
+    {
+        return &(**this);
+    }
+
+    _static_rbtree_iterator& operator++()
+    {
+        m_i = _ops::next(m_links, m_i);
+        return *this;
+    }
+
+    _static_rbtree_iterator operator++(int)
+    {
+        auto it = *this;
+        ++(*this);
+        return it;
+    }
+
+    // decrementing end() yields the last element
+    _static_rbtree_iterator& operator--()
+    {
+        m_i = (m_i != _links::nil()) ? _ops::prev(m_links, m_i) : _ops::maximum(m_links, *m_links.m_root);
+        return *this;
+    }
+
+    _static_rbtree_iterator operator--(int)
+    {
+        auto it = *this;
+        --(*this);
+        return it;
+    }
+
+    bool operator==(_static_rbtree_iterator const& o) const
+    {
+        return m_i == o.m_i;
+    }
+
+    bool operator!=(_static_rbtree_iterator const& o) const
+    {
+        return !(*this == o);
+    }
+
+  private:
+    _links m_links;
+    Index m_i;
+};
+
+// Red-black tree of at most N elements stored inline in the tree object.
+// Nodes are slots of a fixed array linked by index, so the tree never
+// allocates; erased slots go on a free list threaded through their left
+// links. Balancing is the same code rbtree uses, instantiated over index
+// links instead of pointers.
+template<class Data, std::size_t N, class Comp = std::less<Data>>
+class static_rbtree
+{
+    static_assert(N > 0 && N < 0x7fffffff, "static_rbtree capacity must fit a 31 bit index");
+
+    using _index = _rbtree_index_t<N>;
+    using _node = _rbtree_index_node<Data, _index>;
+    using _links = _rbtree_index_links<_node, _index>;
+    using _ops = _rbtree_link_ops<_links>;
+
+  public:
+    using const_iterator = _static_rbtree_iterator<Data, _index>;
+    using iterator = const_iterator;
+
+    // O(1): slots are only touched once handed out
+    static_rbtree() : m_root(_links::nil()), m_free(_links::nil()), m_used(0), m_size(0)
+    { }
+
+    ~static_rbtree()
+    { clear(); }
+
+    static_rbtree(static_rbtree const&) = delete;
+    static_rbtree& operator=(static_rbtree const&) = delete;
+
+    static constexpr std::size_t capacity()
+    {
+        return N;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    bool full() const
+    {
+        return m_size == N;
+    }
+
+    void clear()
+    {
+        auto l = links();
+        for (auto n = _ops::minimum(l, m_root); n != _links::nil(); n = _ops::next(l, n)) {
+            m_nodes[n].data().~Data();
+        }
+        m_root = _links::nil();
+        m_free = _links::nil();
+        m_used = 0;
+        m_size = 0;
+    }
+
+    const_iterator begin() const
+    {
+        return make_iterator(_ops::minimum(links(), m_root));
+    }
+
+    const_iterator end() const
+    {
+        return make_iterator(_links::nil());
+    }
+
+    bool contains(Data const& d) const
+    {
+        auto n = find_lb(d);
+        return n != _links::nil() && !m_comp(d, m_nodes[n].data());
+    }
+
+    // throws std::length_error if d is new and the tree is full
+    bool insert(Data&& d)
+    {
+        return insert_impl(std::move(d));
+    }
+
+    bool insert(Data const& d)
+    {
+        return insert_impl(d);
+    }
+
+    bool erase(Data const& d)
+    {
+        auto n = find_lb(d);
+        if (n == _links::nil() || m_comp(d, m_nodes[n].data())) return false;
+        _ops::erase(links(), n);
+        m_nodes[n].data().~Data();
+        m_nodes[n].m_left = m_free;
+        m_free = n;
+        m_size = _index(m_size - 1);
+        assert(verify());
+        return true;
+    }
+
+    // range queries
+    const_iterator lower_bound(Data const& x) const
+    {
+        return make_iterator(find_lb(x));
+    }
+
+    const_iterator upper_bound(Data const& x) const
+    {
+        auto n = m_root;
+        auto ub = _links::nil();
+        while (n != _links::nil()) {
+            if (m_comp(x, m_nodes[n].data())) {
+                ub = n;
+                n = m_nodes[n].m_left;
+            } else {
+                n = m_nodes[n].m_right;
+            }
+        }
+        return make_iterator(ub);
+    }
+
+    // calls fn(data) in order for every element in [lo, hi)
+    template<class Fn>
+    void for_each_in_range(Data const& lo, Data const& hi, Fn fn) const
+    {
+        auto const end = find_lb(hi);
+        auto l = links();
+        for (auto n = find_lb(lo); n != end; n = _ops::next(l, n)) {
+            fn(m_nodes[n].data());
+        }
+    }
+
+  private:
+    _index m_root;
+    _index m_free;
+    _index m_used;
+    _index m_size;
+    Comp m_comp;
+    _node m_nodes[N];
+
+    _links links() const
+    {
+        return _links(const_cast<_node*>(m_nodes), const_cast<_index*>(&m_root));
+    }
+
+    const_iterator make_iterator(_index n) const
+    {
+        return const_iterator(links(), n);
+    }
+
+    _index find_lb(Data const& x) const
+    {
+        auto n = m_root;
+        auto lb = _links::nil();
+        while (n != _links::nil()) {
+            if (m_comp(m_nodes[n].data(), x)) {
+                n = m_nodes[n].m_right;
+            } else {
+                lb = n;
+                n = m_nodes[n].m_left;
+            }
+        }
+        return lb;
+    }
+
+    template<class D>
+    bool insert_impl(D&& d)
+    {
+        auto n = m_root;
+        auto parent = _links::nil();
+        auto cand = _links::nil();
+        bool lt = false;
+        // one comparison per level; the last node not greater than d is the
+        // only possible duplicate
+        while (n != _links::nil()) {
+            parent = n;
+            lt = m_comp(d, m_nodes[n].data());
+            if (lt) {
+                n = m_nodes[n].m_left;
+            } else {
+                cand = n;
+                n = m_nodes[n].m_right;
+            }
+        }
+        if (cand != _links::nil() && !m_comp(m_nodes[cand].data(), d)) return false;
+        n = create_node(std::forward<D>(d));
+        auto l = links();
+        l.set_parent(n, parent);
+        if (parent == _links::nil()) {
+            m_root = n;
+        } else if (lt) {
+            m_nodes[parent].m_left = n;
+        } else {
+            m_nodes[parent].m_right = n;
+        }
+        _ops::insert_fixup(l, n);
+        assert(verify());
+        return true;
+    }
+
+    template<class D>
+    _index create_node(D&& d)
+    {
+        _index n;
+        if (m_free != _links::nil()) {
+            n = m_free;
+        } else if (m_used < N) {
+            n = m_used;
+        } else {
+            throw std::length_error("static_rbtree: capacity exceeded");
+        }
+        ::new (static_cast<void*>(&m_nodes[n].m_storage)) Data(std::forward<D>(d));
+        // take the slot only once construction succeeded
+        if (n == m_free) {
+            m_free = m_nodes[n].m_left;
+        } else {
+            m_used = _index(m_used + 1);
+        }
+        m_nodes[n].m_parent_color = _links::color_bit();
+        m_nodes[n].m_left = _links::nil();
+        m_nodes[n].m_right = _links::nil();
+        m_size = _index(m_size + 1);
+        return n;
+    }
+
+    bool verify_node(_index n, std::size_t& black_ht) const
+    {
+        if (n == _links::nil()) {
+            black_ht = 0;
+            return true;
+        }
+        auto l = links();
+        auto const left = l.left(n);
+        auto const right = l.right(n);
+        if (l.color(n) == _RED && (!_ops::is_black(l, left) || !_ops::is_black(l, right))) return false;
+        std::size_t lh = 0, rh = 0;
+        if (!verify_node(left, lh) || !verify_node(right, rh) || lh != rh) return false;
+        black_ht = lh + (l.color(n) == _BLACK);
+        return true;
+    }
+
+    bool verify() const
+    {
+        std::size_t ht = 0;
+        return _ops::is_black(links(), m_root) && verify_node(m_root, ht);
+    }
+};
+
+} // namespace containers
+
+#endif // _RBTREE_STATIC_RBTREE_HPP_
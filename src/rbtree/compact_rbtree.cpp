@@ -0,0 +1,180 @@
+/*! compact_rbtree.cpp */
+
+#include <rbtree/compact_rbtree.hpp>
+
+namespace containers
+{
+
+typedef _rbtree_compact_node_base _cnode;
+
+bool _rbtree_compact_ops::_verify(_cnode* n, size_t& ht)
+{
+    if (!n) {
+        ht = 0;
+        return true;
+    }
+    if (n->color() == _RED) {
+        if (n->left() && n->left()->color() == _RED) return false;
+        if (n->right() && n->right()->color() == _RED) return false;
+    }
+    size_t lh = 0, rh = 0;
+    bool lv = _verify(n->left(), lh);
+    bool rv = _verify(n->right(), rh);
+    if (!lv || !rv || lh != rh) return false;
+    ht = lh + (n->color() == _BLACK);
+    return true;
+}
+
+// rotations return the new subtree root; the caller relinks it
+static _cnode* rotate_left(_cnode* n)
+{
+    auto nnew = n->right();
+    n->set_right(nnew->left());
+    nnew->set_left(n);
+    return nnew;
+}
+
+static _cnode* rotate_right(_cnode* n)
+{
+    auto nnew = n->left();
+    n->set_left(nnew->right());
+    nnew->set_right(n);
+    return nnew;
+}
+
+static void replace_child(_cnode* parent, _cnode* old_child, _cnode* new_child, _cnode** root)
+{
+    if (!parent) {
+        *root = new_child;
+    } else if (parent->left() == old_child) {
+        parent->set_left(new_child);
+    } else {
+        parent->set_right(new_child);
+    }
+}
+
+void _rbtree_compact_ops::insert_rebalance(_cnode** path, std::size_t depth, _cnode** root)
+{
+    // Same cases as _rbtree_ops::insert_rebalance, with parent and grandparent
+    // read off the recorded path instead of from parent links.
+    while (depth >= 2) {
+        auto node = path[depth];
+        auto parent = path[depth - 1];
+        if (parent->color() == _BLACK) break;
+        auto grandparent = path[depth - 2];
+        auto uncle = (grandparent->left() == parent) ? grandparent->right() : grandparent->left();
+        if (uncle && uncle->color() == _RED) {
+            // recolor and continue two levels up
+            parent->set_color(_BLACK);
+            uncle->set_color(_BLACK);
+            grandparent->set_color(_RED);
+            depth -= 2;
+            continue;
+        }
+        // _BLACK uncle: bring an inside child to the outside, then rotate the
+        // grandparent towards the uncle
+        if (parent == grandparent->left()) {
+            if (node == parent->right()) {
+                grandparent->set_left(rotate_left(parent));
+                parent = node;
+            }
+            replace_child(depth >= 3 ? path[depth - 3] : nullptr, grandparent, rotate_right(grandparent), root);
+        } else {
+            if (node == parent->left()) {
+                grandparent->set_right(rotate_right(parent));
+                parent = node;
+            }
+            replace_child(depth >= 3 ? path[depth - 3] : nullptr, grandparent, rotate_left(grandparent), root);
+        }
+        parent->set_color(_BLACK);
+        grandparent->set_color(_RED);
+        break;
+    }
+    (*root)->set_color(_BLACK);
+}
+
+void _rbtree_compact_ops::erase(_cnode** path, std::size_t depth, _cnode* node, _cnode** root)
+{
+    auto const parent = depth > 0 ? path[depth - 1] : nullptr;
+    // child takes the place of the node that leaves its position: node
+    // itself, or its successor when node has two children; left tells on
+    // which side of path[depth - 1] that place is
+    _cnode* child;
+    _rbnode_color removed;
+    bool left;
+    if (node->left() && node->right()) {
+        auto const k = depth++;
+        auto y = node->right();
+        while (y->left() != nullptr) {
+            path[depth++] = y;
+            y = y->left();
+        }
+        removed = y->color();
+        child = y->right();
+        if (depth - 1 == k) {
+            // y is node's right child and keeps its right subtree
+            left = false;
+        } else {
+            path[depth - 1]->set_left(child);
+            y->set_right(node->right());
+            left = true;
+        }
+        y->set_left(node->left());
+        y->set_color(node->color());
+        replace_child(parent, node, y, root);
+        path[k] = y;
+    } else {
+        child = node->left() ? node->left() : node->right();
+        removed = node->color();
+        left = parent && parent->left() == node;
+        replace_child(parent, node, child, root);
+    }
+    if (removed == _RED) return;
+    // Same cases as _rbtree_ops::erase: the path below child is one _BLACK
+    // node short, and the parent and grandparent come from the path.
+    while (depth > 0 && (!child || child->color() == _BLACK)) {
+        auto p = path[depth - 1];
+        auto w = left ? p->right() : p->left();
+        if (w->color() == _RED) {
+            // rotate the _RED sibling above p; child stays below p
+            w->set_color(_BLACK);
+            p->set_color(_RED);
+            replace_child(depth >= 2 ? path[depth - 2] : nullptr, p, left ? rotate_left(p) : rotate_right(p), root);
+            path[depth - 1] = w;
+            path[depth++] = p;
+            w = left ? p->right() : p->left();
+        }
+        auto near = left ? w->left() : w->right();
+        auto far = left ? w->right() : w->left();
+        bool const near_red = near && near->color() == _RED;
+        bool const far_red = far && far->color() == _RED;
+        if (!near_red && !far_red) {
+            // push the missing _BLACK up one level
+            w->set_color(_RED);
+            child = p;
+            --depth;
+            left = depth > 0 && path[depth - 1]->left() == p;
+            continue;
+        }
+        if (!far_red) {
+            // bring the _RED near nephew to the outside
+            near->set_color(_BLACK);
+            w->set_color(_RED);
+            if (left) {
+                p->set_right(rotate_right(w));
+            } else {
+                p->set_left(rotate_left(w));
+            }
+            far = w;
+            w = near;
+        }
+        w->set_color(p->color());
+        p->set_color(_BLACK);
+        far->set_color(_BLACK);
+        replace_child(depth >= 2 ? path[depth - 2] : nullptr, p, left ? rotate_left(p) : rotate_right(p), root);
+        return;
+    }
+    if (child) child->set_color(_BLACK);
+}
+
+} // namespace containers
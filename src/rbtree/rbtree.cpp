@@ -2,6 +2,8 @@
 
 #include <rbtree/rbtree.hpp>
 
+#include <algorithm>
+
 namespace containers
 {
 
@@ -29,4 +31,151 @@ bool _rbtree_ops::_verify_black_ht(_rbtree_node_base* n, size_t& ht)
     return true;
 }
 
+static _rbtree_node_base* build_range(_rbtree_node_base** nodes, std::size_t n, std::size_t depth,
+                                      std::size_t red_depth, _rbtree_node_base* parent)
+{
+    if (n == 0) return nullptr;
+    auto const mid = n / 2;
+    auto r = nodes[mid];
+    r->m_parent_color &= _RBNODE_DEAD_BIT;
+    r->set_parent(parent);
+    r->set_color(depth == red_depth ? _RED : _BLACK);
+    r->set_left(build_range(nodes, mid, depth + 1, red_depth, r));
+    r->set_right(build_range(nodes + mid + 1, n - mid - 1, depth + 1, red_depth, r));
+    return r;
+}
+
+_rbtree_node_base* _rbtree_ops::build(_rbtree_node_base** nodes, std::size_t n)
+{
+    // Splitting at the middle fills every level but the last. Levels
+    // [0, floor(log2(n + 1))) are complete and _BLACK; nodes on the partial
+    // last level are leaves and colored _RED, so every path sees the same
+    // number of _BLACK nodes.
+    std::size_t red_depth = 0;
+    while ((std::size_t(2) << red_depth) <= n + 1) ++red_depth;
+    return build_range(nodes, n, 0, red_depth, nullptr);
+}
+
+bool _rbtree_ops::_verify_ranks(_rbtree_node_base* n, bool weak, long& rank)
+{
+    if (!n) {
+        rank = -1;
+        return true;
+    }
+    long lr = 0, rr = 0;
+    if (!_verify_ranks(n->left(), weak, lr) || !_verify_ranks(n->right(), weak, rr)) return false;
+    // a child whose rank parity differs from n's is a 1-child, else a 2-child
+    bool const odd = n->color() == _RED;
+    long const ld = ((lr & 1) != 0) != odd ? 1 : 2;
+    long const rd = ((rr & 1) != 0) != odd ? 1 : 2;
+    rank = lr + ld;
+    if (rank != rr + rd) return false;
+    if (weak) return n->left() || n->right() || rank == 0;
+    return ld == 1 || rd == 1;
+}
+
+static long rank_range(_rbtree_node_base* n)
+{
+    if (!n) return -1;
+    auto const r = std::max(rank_range(n->left()), rank_range(n->right())) + 1;
+    n->set_color((r & 1) ? _RED : _BLACK);
+    return r;
+}
+
+_rbtree_node_base* _rbtree_ops::build_ranked(_rbtree_node_base** nodes, std::size_t n)
+{
+    // the halves of a middle split differ in height by at most one, so
+    // ranks equal to heights satisfy both AVL and weak AVL rules
+    auto const root = build(nodes, n);
+    rank_range(root);
+    return root;
+}
+
+std::size_t _rbtree_ops::black_height(_rbtree_node_base* n)
+{
+    std::size_t h = 0;
+    for (; n != nullptr; n = n->left()) {
+        h += (n->color() == _BLACK);
+    }
+    return h;
+}
+
+_rbtree_node_base* _rbtree_ops::join(_rbtree_node_base* l, std::size_t lh, _rbtree_node_base* k,
+                                     _rbtree_node_base* r, std::size_t rh, std::size_t& h)
+{
+    // both sides become standalone trees with _BLACK roots
+    if (l) {
+        l->set_parent(nullptr);
+        l->set_color(_BLACK);
+    }
+    if (r) {
+        r->set_parent(nullptr);
+        r->set_color(_BLACK);
+    }
+    k->set_parent(nullptr);
+    if (lh == rh) {
+        k->set_left(l);
+        k->set_right(r);
+        if (l) l->set_parent(k);
+        if (r) r->set_parent(k);
+        k->set_color(_BLACK);
+        h = lh + 1;
+        return k;
+    }
+
+    // Walk down the spine of the taller tree, on the side facing the other
+    // one, to the first _BLACK node c with the black height of the shorter
+    // tree. k, colored _RED, takes c's place with c and the shorter tree as
+    // its children; only a red-red violation can remain, fixed as on insert.
+    bool const tall_left = lh > rh;
+    auto root = tall_left ? l : r;
+    auto const target = tall_left ? rh : lh;
+    h = tall_left ? lh : rh;
+    _rbtree_node_base* p = nullptr;
+    auto c = root;
+    auto ch = h;
+    while (c && !(c->color() == _BLACK && ch == target)) {
+        ch -= (c->color() == _BLACK);
+        p = c;
+        c = tall_left ? c->right() : c->left();
+    }
+    auto const other = tall_left ? r : l;
+    k->set_left(tall_left ? c : other);
+    k->set_right(tall_left ? other : c);
+    if (c) c->set_parent(k);
+    if (other) other->set_parent(k);
+    k->set_parent(p);
+    if (tall_left) {
+        p->set_right(k);
+    } else {
+        p->set_left(k);
+    }
+    k->set_color(_RED);
+    _rbtree_node_base* n = k;
+    while (n) {
+        // a _RED node reaching the root is blackened, growing the tree
+        if (!n->parent() && n->color() == _RED) ++h;
+        if (!insert_rebalance(n, &root)) break;
+        n = n->grandparent();
+    }
+    return root;
+}
+
+_rbtree_node_base* _rbtree_ops::join(_rbtree_node_base* l, _rbtree_node_base* r)
+{
+    if (!l) return r;
+    if (!r) return l;
+    l->set_parent(nullptr);
+    r->set_parent(nullptr);
+    auto k = minimum(r);
+    erase(k, &r);
+    std::size_t h;
+    return join(l, black_height(l), k, r, black_height(r), h);
+}
+
+void _rbtree_ops::erase(_rbtree_node_base* z, _rbtree_node_base** root)
+{
+    _impl::erase(_links(root), z);
+}
+
 } // namespace containers
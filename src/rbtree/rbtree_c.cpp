@@ -0,0 +1,272 @@
+/*! rbtree_c.cpp */
+
+#include <rbtree/rbtree.h>
+#include <rbtree/rbtree.hpp>
+
+#include <new>
+
+using containers::rbtree;
+
+struct rbtree_u64_s
+{
+    rbtree<uint64_t> tree;
+};
+
+struct rbtree_bytes_s
+{
+    rbtree<std::string> tree;
+};
+
+namespace
+{
+
+// no exception may cross the C boundary; allocation failures become -1
+
+template<class Tree, class Key>
+int insert_one(Tree& t, Key&& k)
+{
+    try {
+        return t.insert(std::forward<Key>(k)) ? 1 : 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+void set_bit(uint8_t* bitmap, size_t i, bool v)
+{
+    auto const mask = uint8_t(1u << (i % 8));
+    if (v) {
+        bitmap[i / 8] |= mask;
+    } else {
+        bitmap[i / 8] &= uint8_t(~mask);
+    }
+}
+
+std::string bytes(void const* key, size_t len)
+{
+    return std::string(static_cast<char const*>(key), len);
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////
+// uint64_t keys
+
+rbtree_u64_t* rbtree_u64_create(void)
+{
+    return new (std::nothrow) rbtree_u64_s();
+}
+
+void rbtree_u64_destroy(rbtree_u64_t* t)
+{
+    delete t;
+}
+
+size_t rbtree_u64_size(rbtree_u64_t const* t)
+{
+    return t->tree.size();
+}
+
+void rbtree_u64_clear(rbtree_u64_t* t)
+{
+    t->tree.clear();
+}
+
+int rbtree_u64_insert(rbtree_u64_t* t, uint64_t key)
+{
+    return insert_one(t->tree, key);
+}
+
+int rbtree_u64_erase(rbtree_u64_t* t, uint64_t key)
+{
+    return t->tree.erase(key) ? 1 : 0;
+}
+
+int rbtree_u64_contains(rbtree_u64_t const* t, uint64_t key)
+{
+    return t->tree.contains(key) ? 1 : 0;
+}
+
+int rbtree_u64_insert_many(rbtree_u64_t* t, uint64_t const* keys, size_t n, size_t* inserted)
+{
+    size_t cnt = 0;
+    int rc = 0;
+    for (size_t i = 0; i < n; ++i) {
+        auto const r = insert_one(t->tree, keys[i]);
+        if (r < 0) {
+            rc = -1;
+            break;
+        }
+        cnt += size_t(r);
+    }
+    if (inserted) *inserted = cnt;
+    return rc;
+}
+
+size_t rbtree_u64_erase_many(rbtree_u64_t* t, uint64_t const* keys, size_t n)
+{
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        cnt += t->tree.erase(keys[i]) ? 1 : 0;
+    }
+    return cnt;
+}
+
+size_t rbtree_u64_contains_many(rbtree_u64_t const* t, uint64_t const* keys, size_t n, uint8_t* bitmap)
+{
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        bool const found = t->tree.contains(keys[i]);
+        set_bit(bitmap, i, found);
+        cnt += found ? 1 : 0;
+    }
+    return cnt;
+}
+
+size_t rbtree_u64_range_scan(rbtree_u64_t const* t, uint64_t lo, uint64_t hi, uint64_t* out, size_t cap)
+{
+    size_t cnt = 0;
+    auto const end = t->tree.end();
+    for (auto it = t->tree.lower_bound(lo); cnt < cap && it != end && *it <= hi; ++it) {
+        out[cnt++] = *it;
+    }
+    return cnt;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// byte-string keys
+
+rbtree_bytes_t* rbtree_bytes_create(void)
+{
+    return new (std::nothrow) rbtree_bytes_s();
+}
+
+void rbtree_bytes_destroy(rbtree_bytes_t* t)
+{
+    delete t;
+}
+
+size_t rbtree_bytes_size(rbtree_bytes_t const* t)
+{
+    return t->tree.size();
+}
+
+void rbtree_bytes_clear(rbtree_bytes_t* t)
+{
+    t->tree.clear();
+}
+
+int rbtree_bytes_insert(rbtree_bytes_t* t, void const* key, size_t len)
+{
+    try {
+        return insert_one(t->tree, bytes(key, len));
+    } catch (...) {
+        return -1;
+    }
+}
+
+int rbtree_bytes_erase(rbtree_bytes_t* t, void const* key, size_t len)
+{
+    try {
+        return t->tree.erase(bytes(key, len)) ? 1 : 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int rbtree_bytes_contains(rbtree_bytes_t const* t, void const* key, size_t len)
+{
+    try {
+        return t->tree.contains(bytes(key, len)) ? 1 : 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int rbtree_bytes_insert_many(rbtree_bytes_t* t, void const* const* keys, size_t const* lens,
+                             size_t n, size_t* inserted)
+{
+    size_t cnt = 0;
+    int rc = 0;
+    try {
+        // one scratch string for the batch, reused for keys that are
+        // already present
+        std::string k;
+        for (size_t i = 0; i < n; ++i) {
+            k.assign(static_cast<char const*>(keys[i]), lens[i]);
+            if (t->tree.insert(std::move(k))) ++cnt;
+        }
+    } catch (...) {
+        rc = -1;
+    }
+    if (inserted) *inserted = cnt;
+    return rc;
+}
+
+int rbtree_bytes_erase_many(rbtree_bytes_t* t, void const* const* keys, size_t const* lens,
+                           size_t n, size_t* erased)
+{
+    size_t cnt = 0;
+    int rc = 0;
+    try {
+        std::string k;
+        for (size_t i = 0; i < n; ++i) {
+            k.assign(static_cast<char const*>(keys[i]), lens[i]);
+            cnt += t->tree.erase(k) ? 1 : 0;
+        }
+    } catch (...) {
+        rc = -1;
+    }
+    if (erased) *erased = cnt;
+    return rc;
+}
+
+int rbtree_bytes_contains_many(rbtree_bytes_t const* t, void const* const* keys,
+                               size_t const* lens, size_t n, uint8_t* bitmap, size_t* found)
+{
+    size_t cnt = 0;
+    size_t i = 0;
+    int rc = 0;
+    try {
+        std::string k;
+        for (; i < n; ++i) {
+            k.assign(static_cast<char const*>(keys[i]), lens[i]);
+            bool const found = t->tree.contains(k);
+            set_bit(bitmap, i, found);
+            cnt += found ? 1 : 0;
+        }
+    } catch (...) {
+        rc = -1;
+        for (; i < n; ++i) {
+            set_bit(bitmap, i, false);
+        }
+    }
+    if (found) *found = cnt;
+    return rc;
+}
+
+int rbtree_bytes_range_scan(rbtree_bytes_t const* t, void const* lo, size_t lo_len,
+                            void const* hi, size_t hi_len, char* buf, size_t buf_cap,
+                            size_t* lens, size_t max_keys, size_t* copied)
+{
+    size_t cnt = 0;
+    int rc = 0;
+    try {
+        auto const end = t->tree.end();
+        auto it = lo ? t->tree.lower_bound(bytes(lo, lo_len)) : t->tree.begin();
+        std::string const hi_key = hi ? bytes(hi, hi_len) : std::string();
+        size_t used = 0;
+        for (; cnt < max_keys && it != end; ++it) {
+            if (hi && hi_key < *it) break;
+            auto const len = it->size();
+            if (len > buf_cap - used) break;
+            it->copy(buf + used, len);
+            used += len;
+            lens[cnt++] = len;
+        }
+    } catch (...) {
+        rc = -1;
+    }
+    if (copied) *copied = cnt;
+    return rc;
+}
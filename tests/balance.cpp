@@ -0,0 +1,393 @@
+/*! balance.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/rbtree.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace containers;
+
+namespace {
+
+template<class Tree>
+void check_basic()
+{
+    Tree t;
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    testThat(t.erase_range(0, 10) == 0);
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.insert(i) == true);
+        testThat(t.insert(i) == false);
+    }
+    testThat(t.size() == size_t(N));
+    testThat(t.front() == 0);
+    testThat(t.back() == N - 1);
+    for (int i = 0; i < N; i += 3) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+    }
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == (i % 3 != 0));
+    }
+    // 100..199 less the multiples of 3
+    testThat(t.erase_range(100, 200) == 67);
+    testThat(t.contains(99) == false);
+    testThat(t.contains(100) == false);
+    testThat(t.contains(200) == true);
+    t.clear();
+    testThat(t.empty());
+}
+
+// random operations against std::set; t may be set up for lazy erase
+template<class Tree>
+void check_random(Tree& t)
+{
+    std::set<int> s;
+    std::srand(17);
+    for (int i = 0; i < 30000; ++i) {
+        auto const k = std::rand() % 2000;
+        switch (std::rand() % 10) {
+        case 0:
+        case 1:
+        case 2:
+            testThat(t.erase(k) == (s.erase(k) == 1));
+            break;
+        case 3: {
+            auto nh = t.extract(k);
+            testThat(nh.empty() == (s.erase(k) == 0));
+            if (!nh.empty()) {
+                nh.value() += 2000;
+                testThat(t.insert(std::move(nh)) == s.insert(k + 2000).second);
+            }
+            break;
+        }
+        case 4:
+            if (!s.empty() && std::rand() % 4 == 0) {
+                if (k % 2) {
+                    t.pop_front();
+                    s.erase(s.begin());
+                } else {
+                    t.pop_back();
+                    s.erase(std::prev(s.end()));
+                }
+            }
+            break;
+        case 5:
+            if (std::rand() % 100 == 0) {
+                auto const hi = k + 50;
+                testThat(t.erase_range(k, hi) == size_t(std::distance(s.lower_bound(k), s.lower_bound(hi))));
+                s.erase(s.lower_bound(k), s.lower_bound(hi));
+            }
+            break;
+        default:
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    t.compact();
+    testThat(t.tombstones() == 0);
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    for (auto k : s) {
+        testThat(t.erase(k));
+    }
+    testThat(t.empty());
+}
+
+// A bare tree of int keys driven directly by one set of balancing
+// operations, over links that count rotations.
+struct counting_links : _rbtree_ptr_links
+{
+    counting_links(_rbtree_node_base** root, std::size_t* rotations) : _rbtree_ptr_links(root), m_rotations(rotations)
+    { }
+
+    void rotated() const
+    {
+        ++*m_rotations;
+    }
+
+    std::size_t* m_rotations;
+};
+
+struct knode : _rbtree_node_base
+{
+    int key;
+};
+
+template<class Ops, class Balance>
+struct raw_tree
+{
+    explicit raw_tree(std::size_t cap) : root(nullptr), rotations(0), nodes(new knode[cap]), used(0)
+    { }
+
+    counting_links links()
+    {
+        return counting_links(&root, &rotations);
+    }
+
+    void insert(int k)
+    {
+        _rbtree_node_base* p = nullptr;
+        bool left = false;
+        for (auto n = root; n != nullptr; n = left ? n->left() : n->right()) {
+            p = n;
+            left = k < static_cast<knode*>(n)->key;
+        }
+        auto n = &nodes[used++];
+        n->key = k;
+        n->m_parent_color = 0;
+        n->set_parent(p);
+        n->set_color(_RED);
+        n->set_left(nullptr);
+        n->set_right(nullptr);
+        if (!p) {
+            root = n;
+        } else if (left) {
+            p->set_left(n);
+        } else {
+            p->set_right(n);
+        }
+        Ops::insert_fixup(links(), n);
+    }
+
+    void erase(int k)
+    {
+        auto n = root;
+        while (static_cast<knode*>(n)->key != k) {
+            n = k < static_cast<knode*>(n)->key ? n->left() : n->right();
+        }
+        Ops::erase(links(), n);
+    }
+
+    static bool verify(_rbtree_node_base* n)
+    {
+        return Balance::verify(n);
+    }
+
+    static std::size_t height(_rbtree_node_base* n)
+    {
+        return n ? 1 + std::max(height(n->left()), height(n->right())) : 0;
+    }
+
+    _rbtree_node_base* root;
+    std::size_t rotations;
+    std::unique_ptr<knode[]> nodes;
+    std::size_t used;
+};
+
+using raw_rb = raw_tree<_rbtree_link_ops<counting_links>, rb_balance>;
+using raw_avl = raw_tree<_rbtree_rank_ops<counting_links, false>, avl_balance>;
+using raw_wavl = raw_tree<_rbtree_rank_ops<counting_links, true>, wavl_balance>;
+
+template<class Raw>
+void check_raw(bool avl)
+{
+    const int N = 4000;
+    Raw t(N);
+    std::vector<int> keys;
+    for (int i = 0; i < N; ++i) {
+        keys.push_back(i);
+    }
+    std::srand(5);
+    for (int i = N - 1; i > 0; --i) {
+        std::swap(keys[i], keys[std::rand() % (i + 1)]);
+    }
+    for (int i = 0; i < N; ++i) {
+        t.insert(keys[i]);
+        if (i % 97 == 0) testThat(Raw::verify(t.root));
+    }
+    testThat(Raw::verify(t.root));
+    // AVL height is below 1.44 log2(n + 2)
+    if (avl) testThat(double(Raw::height(t.root)) < 1.4405 * std::log2(double(N + 2)));
+    for (int i = 0; i < N; i += 2) {
+        t.erase(keys[i]);
+        if (i % 97 == 0) testThat(Raw::verify(t.root));
+    }
+    testThat(Raw::verify(t.root));
+    for (int i = 1; i < N; i += 2) {
+        t.erase(keys[i]);
+    }
+    testThat(t.root == nullptr);
+}
+
+// height and rotations after ascending inserts, random inserts, and then
+// erasing every other key
+template<class Raw>
+void shape(char const* name)
+{
+    auto const n = PERFN;
+    Raw seq(n);
+    std::vector<int> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        seq.insert(int(i));
+        keys[i] = int(i);
+    }
+    std::srand(29);
+    for (size_t i = n - 1; i > 0; --i) {
+        std::swap(keys[i], keys[std::size_t(std::rand()) % (i + 1)]);
+    }
+    Raw rnd(n);
+    for (size_t i = 0; i < n; ++i) {
+        rnd.insert(keys[i]);
+    }
+    auto const ins_rot = rnd.rotations;
+    auto const ins_ht = Raw::height(rnd.root);
+    for (size_t i = 0; i < n; i += 2) {
+        rnd.erase(keys[i]);
+    }
+    std::cout << name << ": height seq " << Raw::height(seq.root) << " rnd " << ins_ht
+              << " erased " << Raw::height(rnd.root) << ", rotations/insert "
+              << double(ins_rot) / double(n) << " rotations/erase "
+              << double(rnd.rotations - ins_rot) / double(n / 2) << " : ";
+}
+
+// Keys in [0, 2n) with n present; every op is a lookup with probability
+// reads/100, else an insert or erase of a random key, so the size stays
+// around n.
+template<class Tree>
+void time_mix(char const* name)
+{
+    auto const n = PERFN;
+    for (unsigned reads : {0u, 50u, 90u, 99u}) {
+        Tree t;
+        for (size_t i = 0; i < n; ++i) {
+            t.insert((i * 2654435761u) % (2 * n));
+        }
+        const size_t OPS = PERFN * 10;
+        std::vector<size_t> keys(OPS);
+        std::vector<unsigned> ops(OPS);
+        std::srand(23);
+        for (size_t i = 0; i < OPS; ++i) {
+            keys[i] = std::size_t(std::rand()) % (2 * n);
+            ops[i] = unsigned(std::rand() % 100);
+        }
+        auto a = std::chrono::high_resolution_clock::now();
+        size_t hits = 0;
+        for (size_t i = 0; i < OPS; ++i) {
+            if (ops[i] < reads) {
+                hits += t.contains(keys[i]);
+            } else if (ops[i] % 2) {
+                hits += t.insert(keys[i]);
+            } else {
+                hits += t.erase(keys[i]);
+            }
+        }
+        auto b = std::chrono::high_resolution_clock::now();
+        // the same operations on std::set, untimed
+        std::set<size_t> s;
+        for (size_t i = 0; i < n; ++i) {
+            s.insert((i * 2654435761u) % (2 * n));
+        }
+        size_t expect = 0;
+        for (size_t i = 0; i < OPS; ++i) {
+            if (ops[i] < reads) {
+                expect += s.count(keys[i]);
+            } else if (ops[i] % 2) {
+                expect += s.insert(keys[i]).second;
+            } else {
+                expect += s.erase(keys[i]);
+            }
+        }
+        testThat(hits == expect);
+        testThat(t.size() == s.size());
+        std::cout << name << "@" << reads << "%r: ";
+        print_time_taken(a, b);
+    }
+}
+
+} // namespace
+
+void balance0(void)
+{
+    check_basic<rbtree<int>>();
+    check_basic<avl_tree<int>>();
+    check_basic<wavl_tree<int>>();
+    // the policy costs no space
+    testThat(sizeof(avl_tree<int>) == sizeof(rbtree<int>));
+    testThat(sizeof(wavl_tree<int>) == sizeof(rbtree<int>));
+}
+
+void balance1_random(void)
+{
+    avl_tree<int> a;
+    check_random(a);
+    wavl_tree<int> w;
+    check_random(w);
+    lazy_rbtree<int, std::less<int>, std::allocator<int>, avl_balance> la;
+    la.set_max_tombstone_ratio(0.5f);
+    check_random(la);
+    lazy_rbtree<int, std::less<int>, std::allocator<int>, wavl_balance> lw;
+    lw.set_max_tombstone_ratio(0.5f);
+    check_random(lw);
+}
+
+void balance2_raw(void)
+{
+    check_raw<raw_rb>(false);
+    check_raw<raw_avl>(true);
+    check_raw<raw_wavl>(false);
+}
+
+void balance2_strings(void)
+{
+    // prefixed nodes rebalance the same way
+    avl_tree<std::string> t;
+    std::set<std::string> s;
+    std::srand(3);
+    for (int i = 0; i < 5000; ++i) {
+        auto k = std::to_string(std::rand() % 1500);
+        if (std::rand() % 3 == 0) {
+            testThat(t.erase(k) == (s.erase(k) == 1));
+        } else {
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+    }
+    testThat(std::vector<std::string>(t.begin(), t.end()) == std::vector<std::string>(s.begin(), s.end()));
+}
+
+void balance3_shape(void)
+{
+    shape<raw_rb>("rb");
+    shape<raw_avl>("avl");
+    shape<raw_wavl>("wavl");
+}
+
+void rbt3_time_mixed(void)
+{
+    time_mix<rbtree<size_t>>("rbtree<size_t>");
+}
+
+void avl3_time_mixed(void)
+{
+    time_mix<avl_tree<size_t>>("avl_tree<size_t>");
+}
+
+void wavl3_time_mixed(void)
+{
+    time_mix<wavl_tree<size_t>>("wavl_tree<size_t>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(balance)
+{
+    addTest(balance0);
+    addTest(balance1_random);
+    addTest(balance2_raw);
+    addTest(balance2_strings);
+    addTest(balance3_shape);
+    addTest(rbt3_time_mixed);
+    addTest(avl3_time_mixed);
+    addTest(wavl3_time_mixed);
+}
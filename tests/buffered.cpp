@@ -0,0 +1,338 @@
+/*! buffered.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/buffered_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace containers;
+
+namespace {
+
+// finds every position, including hits in the scalar tail, and misses
+template<class T>
+void check_find()
+{
+    std::vector<T> v;
+    for (int i = 0; i < 37; ++i) {
+        v.push_back(T(i * 3 + 1));
+    }
+    std::less<T> c;
+    for (int i = 0; i < 37; ++i) {
+        testThat(_rbtree_buffer_find(v.data(), v.size(), T(i * 3 + 1), c, std::true_type()) == size_t(i));
+        testThat(_rbtree_buffer_find(v.data(), v.size(), T(i * 3 + 2), c, std::true_type()) == v.size());
+    }
+    testThat(_rbtree_buffer_find(v.data(), 0, T(1), c, std::true_type()) == 0);
+}
+
+int g_copies = 0;
+int g_copies_left = -1;
+
+// counts copies, and a copy can be made to throw; moves may throw unless
+// Nothrow, as far as the type system knows
+template<bool Nothrow>
+struct key
+{
+    int v;
+    key(int x) : v(x)
+    { }
+    key(key const& o) : v(o.v)
+    {
+        if (g_copies_left == 0) throw std::runtime_error("copy");
+        if (g_copies_left > 0) --g_copies_left;
+        ++g_copies;
+    }
+    key(key&& o) noexcept(Nothrow) : v(o.v)
+    { }
+    key& operator=(key const&) = default;
+    key& operator=(key&& o) noexcept(Nothrow)
+    {
+        v = o.v;
+        return *this;
+    }
+    bool operator<(key const& o) const
+    {
+        return v < o.v;
+    }
+};
+
+} // namespace
+
+void buffered0(void)
+{
+    testThat((_rbtree_simd_keys<int, std::less<int>>::enabled));
+    testThat((_rbtree_simd_keys<double, std::greater<double>>::enabled));
+    testThat(!(_rbtree_simd_keys<std::string, std::less<std::string>>::enabled));
+    check_find<int8_t>();
+    check_find<uint16_t>();
+    check_find<int32_t>();
+    check_find<uint64_t>();
+    check_find<float>();
+    check_find<double>();
+    // only the upper half of a 64 bit key matches
+    std::vector<uint64_t> v(4, uint64_t(7) << 32);
+    testThat(_rbtree_buffer_find(v.data(), v.size(), uint64_t(7) << 32 | 1, std::less<uint64_t>(), std::true_type()) == 4);
+    std::vector<double> z(4, 0.0);
+    testThat(_rbtree_buffer_find(z.data(), z.size(), -0.0, std::less<double>(), std::true_type()) == 0);
+
+    buffered_rbtree<int> t(4);
+    testThat(t.empty());
+    testThat(t.buffer_capacity() == 4);
+    t.insert(3);
+    t.insert(1);
+    t.insert(3);
+    testThat(t.buffered() == 2);
+    testThat(!t.empty());
+    testThat(t.contains(1));
+    testThat(t.contains(2) == false);
+    // counting does not flush
+    auto const& c = t;
+    testThat(c.size() == 2);
+    testThat(t.buffered() == 2);
+    testThat(t.tree().size() == 2);
+    testThat(t.buffered() == 0);
+    // staged again, and dropped when merged
+    t.insert(1);
+    testThat(t.buffered() == 1);
+    testThat(c.size() == 2);
+    t.insert(2);
+    testThat(t.erase(2) == true);
+    testThat(t.erase(2) == false);
+    // in the buffer and in the tree at once
+    testThat(t.erase(1) == true);
+    testThat(t.contains(1) == false);
+    testThat(t.erase(3) == true);
+    testThat(t.buffered() == 0);
+    testThat(t.empty());
+    t.insert(1);
+    for (int i = 10; i < 13; ++i) {
+        t.insert(i);
+    }
+    // the fourth insert filled the buffer
+    testThat(t.buffered() == 0);
+    testThat(std::vector<int>(t.tree().begin(), t.tree().end()) == std::vector<int>({1, 10, 11, 12}));
+    t.clear();
+    testThat(t.empty());
+}
+
+template<class Key, class Make>
+void buffered_random(Make make)
+{
+    buffered_rbtree<Key> t(32);
+    std::set<Key> s;
+    std::srand(11);
+    for (int i = 0; i < 20000; ++i) {
+        auto const k = make(std::rand() % 3000);
+        switch (std::rand() % 8) {
+        case 0:
+            testThat(t.erase(k) == (s.erase(k) == 1));
+            break;
+        case 1:
+            testThat(t.contains(k) == (s.count(k) == 1));
+            break;
+        case 2:
+            if (std::rand() % 50 == 0) t.flush();
+            break;
+        default:
+            t.insert(k);
+            s.insert(k);
+        }
+        testThat(t.empty() == s.empty());
+        if (i % 100 == 0) testThat(t.size() == s.size());
+    }
+    testThat(std::vector<Key>(t.tree().begin(), t.tree().end()) == std::vector<Key>(s.begin(), s.end()));
+}
+
+void buffered1_random(void)
+{
+    buffered_random<long>([](int i) { return long(i) * 1000003; });
+    buffered_random<std::string>([](int i) { return std::to_string(i); });
+}
+
+void buffered2_flush(void)
+{
+    // keys move into the tree
+    buffered_rbtree<key<true>> m(8);
+    g_copies = 0;
+    for (int i = 0; i < 20; ++i) {
+        m.insert(key<true>(i));
+    }
+    m.flush();
+    testThat(g_copies == 0);
+    testThat(m.tree().size() == 20);
+
+    // keys that might throw on a move are copied, and a copy fails
+    buffered_rbtree<key<false>> t(8);
+    for (int i = 0; i < 8; i += 2) {
+        t.insert(key<false>(i));
+    }
+    t.flush();
+    for (int i = 7; i > 0; i -= 2) {
+        t.insert(key<false>(i));
+    }
+    t.insert(key<false>(2));
+    testThat(t.buffered() == 5);
+    g_copies_left = 2;
+    bool threw = false;
+    try {
+        t.flush();
+    } catch (std::runtime_error const&) {
+        threw = true;
+    }
+    g_copies_left = -1;
+    testThat(threw);
+    // 1 and 3 were copied in and 2 was present; 5 and 7 stay staged
+    testThat(t.buffered() == 2);
+    testThat(t.size() == 8);
+    testThat(t.contains(key<false>(5)) && t.contains(key<false>(7)));
+    std::vector<int> got;
+    for (auto const& k : t.tree()) {
+        got.push_back(k.v);
+    }
+    testThat(got == std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+void rbt2_insert_hint(void)
+{
+    rbtree<int> t;
+    testThat(t.insert(t.end(), 10) == true);
+    testThat(t.insert(t.end(), 30) == true);
+    // right hints, then wrong ones, then a duplicate
+    testThat(t.insert(t.find(30), 20) == true);
+    testThat(t.insert(t.begin(), 5) == true);
+    testThat(t.insert(t.begin(), 40) == true);
+    testThat(t.insert(t.end(), 1) == true);
+    testThat(t.insert(t.find(20), 20) == false);
+    testThat(t.insert(t.find(30), 20) == false);
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>({1, 5, 10, 20, 30, 40}));
+}
+
+void rbt2_insert_batch(void)
+{
+    lazy_rbtree<int> t;
+    testThat(t.insert_batch((int*)nullptr, (int*)nullptr) == 0);
+    for (int i = 0; i < 100; i += 2) {
+        t.insert(i);
+    }
+    std::vector<int> b;
+    for (int i = 0; i < 120; i += 3) {
+        b.push_back(i);
+    }
+    b.push_back(150);
+    b.push_back(150);
+    // the odd multiples of 3 below 100, those in [100, 120), and 150 once
+    testThat(t.insert_batch(b.begin(), b.end()) == 17 + 6 + 1);
+    std::set<int> s;
+    for (int i = 0; i < 100; i += 2) {
+        s.insert(i);
+    }
+    s.insert(b.begin(), b.end());
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    // tombstones come back to life
+    t.set_max_tombstone_ratio(10);
+    testThat(t.erase(6) && t.erase(8));
+    int const again[] = {6, 7, 8, 8};
+    testThat(t.insert_batch(again, again + 4) == 3);
+    testThat(t.tombstones() == 0);
+    // into an empty tree
+    rbtree<std::string> u;
+    std::vector<std::string> w;
+    for (int i = 100; i < 400; ++i) {
+        w.push_back(std::to_string(i));
+    }
+    testThat(u.insert_batch(w.begin(), w.end()) == w.size());
+    testThat(std::vector<std::string>(u.begin(), u.end()) == w);
+    // keys converted to Data, long enough to live on the heap
+    std::vector<std::string> names;
+    for (int i = 0; i < 40; ++i) {
+        names.push_back("a key too long to be stored inline " + std::to_string(100 + i));
+    }
+    std::vector<char const*> c;
+    for (size_t i = 0; i < names.size(); i += 2) {
+        c.push_back(names[i].c_str());
+    }
+    rbtree<std::string> v;
+    for (size_t i = 1; i < names.size(); i += 4) {
+        v.insert(names[i]);
+    }
+    testThat(v.insert_batch(c.begin(), c.end()) == c.size());
+    testThat(v.insert_batch(c.begin(), c.end()) == 0);
+    for (size_t i = 0; i < names.size(); ++i) {
+        testThat(v.contains(names[i]) == (i % 2 == 0 || i % 4 == 1));
+    }
+}
+
+namespace {
+
+// Bursts of random inserts into a tree that already holds PERFN keys,
+// with a lookup of an earlier key after every burst, which always hits.
+template<class Tree>
+void time_ingest(char const* name, Tree& t, std::vector<size_t> const& keys)
+{
+    for (size_t i = 0; i < PERFN; ++i) {
+        t.insert(i * 4);
+    }
+    auto a = std::chrono::high_resolution_clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        t.insert(keys[i]);
+        if (i % 256 == 0) found += t.contains(keys[i / 2]);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(found == (keys.size() + 255) / 256);
+    std::set<size_t> s(keys.begin(), keys.end());
+    for (size_t i = 0; i < PERFN; ++i) {
+        s.insert(i * 4);
+    }
+    testThat(t.size() == s.size());
+    std::cout << name << ": ";
+    print_time_taken(a, b);
+}
+
+std::vector<size_t> ingest_keys()
+{
+    std::vector<size_t> keys(PERFN * 10);
+    std::srand(41);
+    for (auto& k : keys) {
+        k = std::size_t(std::rand()) % (PERFN * 40);
+    }
+    return keys;
+}
+
+} // namespace
+
+void rbt3_time_ingest(void)
+{
+    rbtree<size_t> t;
+    time_ingest("rbtree<size_t>", t, ingest_keys());
+}
+
+void buffered3_time_ingest(void)
+{
+    auto const keys = ingest_keys();
+    for (size_t cap : {16, 64, 256}) {
+        buffered_rbtree<size_t> t(cap);
+        time_ingest(("buffered_rbtree<size_t>@" + std::to_string(cap)).c_str(), t, keys);
+    }
+}
+
+//////////////////////////////////////////
+
+setupSuite(buffered)
+{
+    addTest(buffered0);
+    addTest(buffered1_random);
+    addTest(buffered2_flush);
+    addTest(rbt2_insert_hint);
+    addTest(rbt2_insert_batch);
+    addTest(rbt3_time_ingest);
+    addTest(buffered3_time_ingest);
+}
@@ -0,0 +1,121 @@
+/*! capi.c */
+
+#include "defs.h"
+
+#include <rbtree/rbtree.h>
+
+#include <string.h>
+
+static int bit(uint8_t const* bitmap, size_t i)
+{
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+void capi_u64(void)
+{
+    rbtree_u64_t* t = rbtree_u64_create();
+    uint64_t keys[100];
+    uint64_t probe[200];
+    uint8_t bitmap[25];
+    uint64_t out[16];
+    size_t i, n, inserted = 0;
+
+    testThat(t != 0);
+    testThat(rbtree_u64_size(t) == 0);
+    testThat(rbtree_u64_insert(t, 7) == 1);
+    testThat(rbtree_u64_insert(t, 7) == 0);
+    testThat(rbtree_u64_contains(t, 7) == 1);
+    testThat(rbtree_u64_erase(t, 7) == 1);
+    testThat(rbtree_u64_erase(t, 7) == 0);
+    testThat(rbtree_u64_contains(t, 7) == 0);
+
+    /* even keys */
+    for (i = 0; i < 100; ++i) {
+        keys[i] = 2 * i;
+    }
+    testThat(rbtree_u64_insert_many(t, keys, 100, &inserted) == 0);
+    testThat(inserted == 100);
+    testThat(rbtree_u64_insert_many(t, keys, 100, &inserted) == 0);
+    testThat(inserted == 0);
+    testThat(rbtree_u64_size(t) == 100);
+
+    for (i = 0; i < 200; ++i) {
+        probe[i] = i;
+    }
+    memset(bitmap, 0xff, sizeof(bitmap));
+    testThat(rbtree_u64_contains_many(t, probe, 200, bitmap) == 100);
+    for (i = 0; i < 200; ++i) {
+        testThat(bit(bitmap, i) == (i % 2 == 0));
+    }
+
+    /* scan in pages */
+    n = rbtree_u64_range_scan(t, 11, 41, out, 16);
+    testThat(n == 15);
+    testThat(out[0] == 12 && out[14] == 40);
+    n = rbtree_u64_range_scan(t, 0, UINT64_MAX, out, 16);
+    testThat(n == 16);
+    n = rbtree_u64_range_scan(t, out[15] + 1, UINT64_MAX, out, 16);
+    testThat(n == 16 && out[0] == 32);
+    testThat(rbtree_u64_range_scan(t, 500, UINT64_MAX, out, 16) == 0);
+
+    testThat(rbtree_u64_erase_many(t, probe, 100) == 50);
+    testThat(rbtree_u64_size(t) == 50);
+    rbtree_u64_clear(t);
+    testThat(rbtree_u64_size(t) == 0);
+    rbtree_u64_destroy(t);
+}
+
+void capi_bytes(void)
+{
+    rbtree_bytes_t* t = rbtree_bytes_create();
+    char const* words[] = { "pear", "apple", "fig", "banana", "apple", "cherry" };
+    size_t lens[6];
+    size_t out_lens[8];
+    uint8_t bitmap[1] = {0};
+    char buf[64];
+    size_t i, n, inserted = 0;
+
+    testThat(t != 0);
+    for (i = 0; i < 6; ++i) {
+        lens[i] = strlen(words[i]);
+    }
+    testThat(rbtree_bytes_insert_many(t, (void const* const*)words, lens, 6, &inserted) == 0);
+    testThat(inserted == 5);
+    testThat(rbtree_bytes_size(t) == 5);
+    testThat(rbtree_bytes_contains(t, "fig", 3) == 1);
+    testThat(rbtree_bytes_contains(t, "fi", 2) == 0);
+    /* embedded zero bytes are part of the key */
+    testThat(rbtree_bytes_insert(t, "fi\0g", 4) == 1);
+    testThat(rbtree_bytes_contains(t, "fi\0g", 4) == 1);
+    testThat(rbtree_bytes_erase(t, "fi\0g", 4) == 1);
+
+    testThat(rbtree_bytes_contains_many(t, (void const* const*)words, lens, 6, bitmap, &n) == 0);
+    testThat(n == 6);
+    testThat(bitmap[0] == 0x3f);
+    testThat(rbtree_bytes_contains_many(t, (void const* const*)words, lens, 6, bitmap, 0) == 0);
+
+    /* whole tree */
+    testThat(rbtree_bytes_range_scan(t, 0, 0, 0, 0, buf, sizeof(buf), out_lens, 8, &n) == 0);
+    testThat(n == 5);
+    testThat(memcmp(buf, "applebananacherryfigpear", 24) == 0);
+    /* bounded on both ends, inclusive */
+    testThat(rbtree_bytes_range_scan(t, "b", 1, "fig", 3, buf, sizeof(buf), out_lens, 8, &n) == 0);
+    testThat(n == 3);
+    testThat(out_lens[0] == 6 && out_lens[1] == 6 && out_lens[2] == 3);
+    testThat(memcmp(buf, "bananacherryfig", 15) == 0);
+    /* stops when the buffer is full */
+    testThat(rbtree_bytes_range_scan(t, 0, 0, 0, 0, buf, 12, out_lens, 8, &n) == 0);
+    testThat(n == 2);
+
+    testThat(rbtree_bytes_erase_many(t, (void const* const*)words, lens, 3, &n) == 0);
+    testThat(n == 3);
+    testThat(rbtree_bytes_erase_many(t, (void const* const*)words, lens, 3, 0) == 0);
+    testThat(rbtree_bytes_size(t) == 2);
+    rbtree_bytes_destroy(t);
+}
+
+setupSuite(capi)
+{
+    addTest(capi_u64);
+    addTest(capi_bytes);
+}
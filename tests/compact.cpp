@@ -0,0 +1,145 @@
+/*! compact.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/compact_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace containers;
+
+void compact0(void)
+{
+    compact_rbtree<int> t;
+    testThat(t.size() == 0);
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    testThat(!std::is_copy_constructible<compact_rbtree<int>>::value);
+    testThat(!std::is_copy_assignable<compact_rbtree<int>>::value);
+    // two link words per node instead of three
+    testThat(sizeof(_rbtree_compact_node_base) == 2*sizeof(void*));
+    testThat(sizeof(_rbtree_node_base) == 3*sizeof(void*));
+    testThat(sizeof(_rbtree_compact_node<size_t>) + sizeof(void*) == sizeof(_rbtree_node<size_t>));
+}
+
+void compact1(void)
+{
+    compact_rbtree<int> t;
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == false);
+        testThat(t.insert(i) == true);
+        testThat(t.insert(i) == false);
+        testThat(t.size() == size_t(i + 1));
+        testThat(t.contains(i) == true);
+    }
+    int expect = 0;
+    for (auto x : t) {
+        testThat(x == expect++);
+    }
+    testThat(expect == N);
+    for (int i = 0; i < N; i += 3) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+    }
+    testThat(t.size() == size_t(N - (N + 2) / 3));
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == (i % 3 != 0));
+    }
+    t.clear();
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+}
+
+void compact2_random(void)
+{
+    compact_rbtree<std::string> t;
+    std::set<std::string> s;
+    std::srand(7);
+    for (int i = 0; i < 8000; ++i) {
+        auto k = std::to_string(std::rand() % 3000);
+        if (std::rand() % 3 == 0) {
+            testThat(t.erase(k) == (s.erase(k) == 1));
+        } else {
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+    }
+    testThat(t.size() == s.size());
+    testThat(std::vector<std::string>(t.begin(), t.end()) ==
+             std::vector<std::string>(s.begin(), s.end()));
+    for (int i = 0; i < 3000; i += 17) {
+        auto k = std::to_string(i);
+        auto lb = t.lower_bound(k);
+        auto slb = s.lower_bound(k);
+        testThat((lb == t.end()) == (slb == s.end()));
+        if (slb != s.end()) testThat(*lb == *slb);
+        auto ub = t.upper_bound(k);
+        auto sub = s.upper_bound(k);
+        testThat((ub == t.end()) == (sub == s.end()));
+        if (sub != s.end()) testThat(*ub == *sub);
+    }
+    std::vector<std::string> got;
+    t.for_each_in_range("2", "3", [&](std::string const& x) { got.push_back(x); });
+    testThat(got == std::vector<std::string>(s.lower_bound("2"), s.lower_bound("3")));
+    for (auto const& k : s) {
+        testThat(t.erase(k) == true);
+    }
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+}
+
+namespace {
+
+// inserts and then erases the same keys, in an order unrelated to them; the
+// multiplier is prime, so the keys are a permutation of [0, N)
+template<class Tree>
+void time_insert(char const* name)
+{
+    Tree t;
+    const size_t N = PERFN;
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i) {
+        t.insert((i * 2654435761u) % N);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(t.size() == N);
+    for (size_t i = 0; i < N; ++i) {
+        t.erase((i * 2654435761u) % N);
+    }
+    auto c = std::chrono::high_resolution_clock::now();
+    testThat(t.empty());
+    std::cout << name << " insert: ";
+    print_time_taken(a, b);
+    std::cout << "erase: ";
+    print_time_taken(b, c);
+}
+
+} // namespace
+
+void rbt3_time_insert_erase(void)
+{
+    time_insert<rbtree<size_t>>("rbtree<size_t>");
+}
+
+void compact3_time_insert_erase(void)
+{
+    time_insert<compact_rbtree<size_t>>("compact_rbtree<size_t>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(compact)
+{
+    addTest(compact0);
+    addTest(compact1);
+    addTest(compact2_random);
+    addTest(rbt3_time_insert_erase);
+    addTest(compact3_time_insert_erase);
+}
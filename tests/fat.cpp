@@ -0,0 +1,195 @@
+/*! fat.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/fat_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace containers;
+
+void fat0(void)
+{
+    fat_rbtree<int> t;
+    testThat(t.size() == 0);
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    testThat(fat_rbtree<int>::node_capacity == 24);
+    testThat(fat_rbtree<size_t>::node_capacity == 12);
+    testThat(!std::is_copy_constructible<fat_rbtree<int>>::value);
+    testThat(!std::is_copy_assignable<fat_rbtree<int>>::value);
+}
+
+void fat1(void)
+{
+    fat_rbtree<int> t;
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == false);
+        testThat(t.insert(i) == true);
+        testThat(t.insert(i) == false);
+        testThat(t.size() == size_t(i + 1));
+        testThat(t.contains(i) == true);
+    }
+    // sequential inserts fill nodes at least half way
+    testThat(t.node_count() <= 2 * (N / fat_rbtree<int>::node_capacity) + 1);
+    int expect = 0;
+    for (auto x : t) {
+        testThat(x == expect++);
+    }
+    testThat(expect == N);
+    for (int i = 0; i < N; i += 2) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+    }
+    testThat(t.size() == size_t(N / 2));
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == (i % 2 == 1));
+    }
+    t.clear();
+    testThat(t.empty());
+    testThat(t.node_count() == 0);
+}
+
+void fat2_random(void)
+{
+    fat_rbtree<int> t;
+    std::set<int> s;
+    std::srand(42);
+    for (int i = 0; i < 20000; ++i) {
+        int x = std::rand() % 2000;
+        if (std::rand() % 3 == 0) {
+            testThat(t.erase(x) == (s.erase(x) == 1));
+        } else {
+            testThat(t.insert(x) == s.insert(x).second);
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    for (int x = -1; x <= 2001; ++x) {
+        testThat(t.contains(x) == (s.count(x) == 1));
+        auto lb = t.lower_bound(x);
+        auto slb = s.lower_bound(x);
+        testThat((lb == t.end()) == (slb == s.end()));
+        if (slb != s.end()) testThat(*lb == *slb);
+        auto ub = t.upper_bound(x);
+        auto sub = s.upper_bound(x);
+        testThat((ub == t.end()) == (sub == s.end()));
+        if (sub != s.end()) testThat(*ub == *sub);
+    }
+    std::vector<int> got;
+    t.for_each_in_range(100, 200, [&](int x) { got.push_back(x); });
+    testThat(got == std::vector<int>(s.lower_bound(100), s.lower_bound(200)));
+}
+
+void fat2_string(void)
+{
+    fat_rbtree<std::string> t;
+    std::set<std::string> s;
+    for (int i = 0; i < 500; ++i) {
+        auto k = std::to_string((i * 7919) % 1000);
+        testThat(t.insert(k) == s.insert(k).second);
+    }
+    for (int i = 0; i < 500; i += 3) {
+        auto k = std::to_string(i);
+        testThat(t.erase(k) == (s.erase(k) == 1));
+    }
+    testThat(std::vector<std::string>(t.begin(), t.end()) ==
+             std::vector<std::string>(s.begin(), s.end()));
+}
+
+namespace {
+
+// keys around the sign bit of T and of its low 32 bits, where the packed
+// compares of the node search have to agree with <
+template<class T>
+void check_packed(T lo, T step)
+{
+    fat_rbtree<T> t;
+    std::set<T> s;
+    for (int i = 0; i < 300; ++i) {
+        T const x = T(lo + T(step * T((i * 7919) % 300)));
+        testThat(t.insert(x) == s.insert(x).second);
+    }
+    for (int i = -1; i <= 300; ++i) {
+        T const x = T(lo + T(step * T(i)) + T(step / 2));
+        auto lb = t.lower_bound(x);
+        auto slb = s.lower_bound(x);
+        testThat((lb == t.end()) == (slb == s.end()));
+        if (slb != s.end()) testThat(*lb == *slb);
+        testThat(t.contains(x) == (s.count(x) == 1));
+    }
+    testThat(std::vector<T>(t.begin(), t.end()) == std::vector<T>(s.begin(), s.end()));
+}
+
+} // namespace
+
+void fat2_packed(void)
+{
+    check_packed<signed char>(-120, 1);
+    check_packed<unsigned char>(0, 1);
+    check_packed<short>(-15000, 100);
+    check_packed<unsigned short>(100, 200);
+    check_packed<int>(-150000000, 1000000);
+    check_packed<unsigned>(0x7fff0000u, 0x1000u);
+    check_packed<long long>(-(1ll << 40), 1ll << 33);
+    check_packed<long long>(-3000000000ll, 10000000ll);
+    check_packed<unsigned long long>(0x7ffffffffff00000ull, 0x10000ull);
+    check_packed<unsigned long long>(0x7ffff000ull, 0x1000ull);
+    check_packed<float>(-100.f, 0.75f);
+    check_packed<double>(-1e10, 1e8);
+}
+
+namespace {
+
+// every key is present; the lookups visit them in a different order
+template<class Tree>
+void time_lookup(char const* name)
+{
+    Tree t;
+    const size_t N = PERFN;
+    for (size_t i = 0; i < N; ++i) {
+        t.insert((i * 2654435761u) % N);
+    }
+    auto a = std::chrono::high_resolution_clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < N; ++i) {
+        found += t.contains((i * 40503u) % N);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(found == N);
+    std::cout << name << ": ";
+    print_time_taken(a, b);
+}
+
+} // namespace
+
+void fat3_time_lookup_size(void)
+{
+    time_lookup<fat_rbtree<size_t>>("fat_rbtree<size_t>");
+}
+
+void rbt3_time_lookup_size(void)
+{
+    time_lookup<rbtree<size_t>>("rbtree<size_t>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(fat)
+{
+    addTest(fat0);
+    addTest(fat1);
+    addTest(fat2_random);
+    addTest(fat2_string);
+    addTest(fat2_packed);
+    addTest(rbt3_time_lookup_size);
+    addTest(fat3_time_lookup_size);
+}
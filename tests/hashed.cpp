@@ -0,0 +1,206 @@
+/*! hashed.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/hashed_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace containers;
+
+void hashed0(void)
+{
+    hashed_rbtree<int> t;
+    testThat(t.size() == 0);
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    testThat(t.contains(0) == false);
+    testThat(t.find(0) == t.end());
+    testThat(t.index_bytes() == 0);
+    testThat(t.max_load_factor() == 0.5f);
+    // the plain tree pays nothing for the index and tombstone hooks
+    testThat(sizeof(rbtree<int>) + 3*sizeof(void*) == sizeof(lazy_rbtree<int>));
+}
+
+void hashed1(void)
+{
+    hashed_rbtree<int> t;
+    const int N = 1200;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == false);
+        testThat(t.insert(i) == true);
+        testThat(t.insert(i) == false);
+        testThat(t.size() == size_t(i + 1));
+        testThat(t.contains(i) == true);
+        testThat(*t.find(i) == i);
+    }
+    testThat(t.load_factor() <= t.max_load_factor());
+    auto const bytes = t.index_bytes();
+    testThat(bytes >= N * sizeof(void*) * 2);
+    // a denser index is smaller
+    t.max_load_factor(0.9f);
+    testThat(t.index_bytes() < bytes);
+    testThat(t.load_factor() <= 0.9f);
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == true);
+    }
+    for (int i = 0; i < N; i += 2) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+    }
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == (i % 2 == 1));
+    }
+    t.clear();
+    testThat(t.empty());
+    testThat(t.contains(1) == false);
+    testThat(t.index_bytes() == 0);
+    testThat(t.insert(1) == true);
+    testThat(t.contains(1) == true);
+}
+
+void hashed2_random(void)
+{
+    // every way of removing elements has to keep the index in sync
+    using hash = std::hash<std::string>;
+    using eq = std::equal_to<std::string>;
+    using less = std::less<std::string>;
+    hashed_rbtree<std::string, hash, eq, less, std::allocator<std::string>, lazy_erase> t;
+    std::set<std::string> s;
+    std::srand(13);
+    t.set_max_tombstone_ratio(0.25f);
+    for (int i = 0; i < 20000; ++i) {
+        auto k = std::to_string(std::rand() % 3000);
+        switch (std::rand() % 8) {
+        case 0:
+            testThat(t.erase(k) == (s.erase(k) == 1));
+            break;
+        case 1: {
+            auto nh = t.extract(k);
+            testThat(nh.empty() == (s.erase(k) == 0));
+            if (!nh.empty()) {
+                nh.value() += "x";
+                testThat(t.insert(std::move(nh)) == s.insert(k + "x").second);
+            }
+            break;
+        }
+        case 2:
+            if (!s.empty() && std::rand() % 10 == 0) {
+                t.pop_front();
+                s.erase(s.begin());
+            }
+            break;
+        case 3:
+            if (std::rand() % 50 == 0) {
+                auto hi = k + "5";
+                testThat(t.erase_range(k, hi) == size_t(std::distance(s.lower_bound(k), s.lower_bound(hi))));
+                s.erase(s.lower_bound(k), s.lower_bound(hi));
+            }
+            break;
+        default:
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(std::vector<std::string>(t.begin(), t.end()) ==
+             std::vector<std::string>(s.begin(), s.end()));
+    for (int i = 0; i < 3000; ++i) {
+        auto k = std::to_string(i);
+        testThat(t.contains(k) == (s.count(k) == 1));
+        testThat(t.contains(k + "x") == (s.count(k + "x") == 1));
+    }
+    t.compact();
+    for (auto const& k : s) {
+        testThat(t.contains(k));
+    }
+}
+
+namespace {
+
+// hits and misses in equal parts, in an order unrelated to the keys: the
+// multiplier is odd, so a probe is even, and present, exactly when i is
+template<class Tree>
+void time_lookup(char const* name)
+{
+    for (size_t n = 10; n <= PERFN * 10; n *= 10) {
+        Tree t;
+        for (size_t i = 0; i < n; ++i) {
+            t.insert(i * 2);
+        }
+        const size_t LOOKUPS = PERFN * 10;
+        auto a = std::chrono::high_resolution_clock::now();
+        size_t found = 0;
+        for (size_t i = 0; i < LOOKUPS; ++i) {
+            found += t.contains((i * 2654435761u) % (2 * n));
+        }
+        auto b = std::chrono::high_resolution_clock::now();
+        testThat(found == (LOOKUPS + 1) / 2);
+        std::cout << name << "@" << n << ": ";
+        print_time_taken(a, b);
+    }
+}
+
+// what the index costs on updates: insert everything, then erase it all
+template<class Tree>
+void time_update(char const* name)
+{
+    Tree t;
+    const size_t N = PERFN;
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i) {
+        t.insert((i * 2654435761u) % N);
+    }
+    for (size_t i = 0; i < N; ++i) {
+        t.erase((i * 40503u) % N);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    // the erased keys cover [0, N) only when 40503 and N are coprime
+    std::set<size_t> erased;
+    for (size_t i = 0; i < N; ++i) {
+        erased.insert((i * 40503u) % N);
+    }
+    testThat(t.size() == N - erased.size());
+    std::cout << name << ": ";
+    print_time_taken(a, b);
+}
+
+} // namespace
+
+void rbt3_time_update_size(void)
+{
+    time_update<rbtree<size_t>>("rbtree<size_t>");
+}
+
+void hashed3_time_update_size(void)
+{
+    time_update<hashed_rbtree<size_t>>("hashed_rbtree<size_t>");
+}
+
+void rbt3_time_lookup_mixed(void)
+{
+    time_lookup<rbtree<size_t>>("rbtree<size_t>");
+}
+
+void hashed3_time_lookup_mixed(void)
+{
+    time_lookup<hashed_rbtree<size_t>>("hashed_rbtree<size_t>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(hashed)
+{
+    addTest(hashed0);
+    addTest(hashed1);
+    addTest(hashed2_random);
+    addTest(rbt3_time_update_size);
+    addTest(hashed3_time_update_size);
+    addTest(rbt3_time_lookup_mixed);
+    addTest(hashed3_time_lookup_mixed);
+}
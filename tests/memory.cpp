@@ -0,0 +1,401 @@
+/*! memory.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/hashed_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace containers;
+
+namespace {
+
+// Fixed-size slots carved from 64-slot slabs, with a free list threaded
+// through released slots. Copies and rebinds share one pool, whose slot
+// size is set by the first allocation.
+struct pool_state
+{
+    static const std::size_t slab_slots = 64;
+
+    std::size_t slot_size = 0;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    std::size_t bumped = slab_slots;
+    void* free_list = nullptr;
+    std::size_t used = 0;
+
+    void* allocate(std::size_t sz)
+    {
+        if (slot_size == 0) slot_size = (sz + 15) / 16 * 16;
+        testThat(sz <= slot_size);
+        ++used;
+        if (free_list) {
+            auto p = free_list;
+            free_list = *static_cast<void**>(p);
+            return p;
+        }
+        if (bumped == slab_slots) {
+            slabs.emplace_back(new char[slab_slots * slot_size]);
+            bumped = 0;
+        }
+        return slabs.back().get() + slot_size * bumped++;
+    }
+
+    void deallocate(void* p)
+    {
+        --used;
+        *static_cast<void**>(p) = free_list;
+        free_list = p;
+    }
+};
+
+template<class T>
+struct pool_allocator
+{
+    using value_type = T;
+
+    pool_allocator() : m_pool(std::make_shared<pool_state>())
+    { }
+    template<class U>
+    pool_allocator(pool_allocator<U> const& o) : m_pool(o.m_pool)
+    { }
+
+    T* allocate(std::size_t n)
+    {
+        if (n != 1) return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(m_pool->allocate(sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n != 1) {
+            ::operator delete(p);
+        } else {
+            m_pool->deallocate(p);
+        }
+    }
+
+    rbtree_pool_stats pool_stats() const
+    {
+        auto const& s = *m_pool;
+        return rbtree_pool_stats{s.slabs.size(), s.slabs.size() * s.slab_slots * s.slot_size,
+                                 s.slabs.size() * s.slab_slots, s.used};
+    }
+
+    std::shared_ptr<pool_state> m_pool;
+};
+
+template<class T, class U>
+bool operator==(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return a.m_pool == b.m_pool;
+}
+
+template<class T, class U>
+bool operator!=(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return !(a == b);
+}
+
+// fails every allocation once armed
+int g_fail_after = -1;
+
+template<class T>
+struct failing_allocator : std::allocator<T>
+{
+    template<class U>
+    struct rebind { using other = failing_allocator<U>; };
+
+    failing_allocator() = default;
+    template<class U>
+    failing_allocator(failing_allocator<U> const&)
+    { }
+
+    T* allocate(std::size_t n)
+    {
+        if (g_fail_after == 0) throw std::bad_alloc();
+        if (g_fail_after > 0) --g_fail_after;
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+// copied, never moved, and the copy can be made to throw
+int g_copies_left = -1;
+
+struct fragile
+{
+    int v;
+    fragile(int x) : v(x)
+    { }
+    fragile(fragile const& o) : v(o.v)
+    {
+        if (g_copies_left == 0) throw std::runtime_error("copy");
+        if (g_copies_left > 0) --g_copies_left;
+    }
+    fragile& operator=(fragile const&) = default;
+    bool operator<(fragile const& o) const
+    {
+        return v < o.v;
+    }
+};
+
+} // namespace
+
+void memory0(void)
+{
+    lazy_rbtree<int> t;
+    auto m = t.memory_usage();
+    testThat(m.nodes == 0);
+    testThat(m.total() == 0);
+    testThat(m.pooled == false);
+    testThat(m.fragmentation() == 0);
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        t.insert(i);
+    }
+    m = t.memory_usage();
+    testThat(m.nodes == size_t(N));
+    testThat(m.node_bytes == N * sizeof(_rbtree_node<int>));
+    testThat(m.data_bytes == N * sizeof(int));
+    testThat(m.link_bytes == N * 3 * sizeof(void*));
+    testThat(m.node_bytes == m.data_bytes + m.link_bytes + m.padding_bytes);
+    testThat(m.payload_bytes == 0);
+    testThat(m.index_bytes == 0);
+    testThat(m.allocator_bytes == m.node_bytes);
+    // tombstones still hold their nodes
+    t.set_max_tombstone_ratio(1);
+    for (int i = 0; i < N; i += 4) {
+        t.erase(i);
+    }
+    testThat(t.memory_usage().nodes == size_t(N));
+    t.compact();
+    testThat(t.memory_usage().nodes == size_t(N - N / 4));
+}
+
+void memory1_payload(void)
+{
+    rbtree<std::string> t;
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        t.insert(std::to_string(i));
+    }
+    auto m = t.memory_usage();
+    // short strings live inside the object; nodes also cache a prefix
+    testThat(m.payload_bytes == 0);
+    testThat(m.link_bytes == N * (3 * sizeof(void*) + sizeof(uint64_t)));
+    testThat(m.node_bytes == m.data_bytes + m.link_bytes + m.padding_bytes);
+    for (int i = 0; i < N; ++i) {
+        t.insert(std::string(100, 'a') + std::to_string(i));
+    }
+    m = t.memory_usage();
+    testThat(m.payload_bytes >= N * 101);
+    testThat(m.total() == m.node_bytes + m.payload_bytes);
+
+    hashed_rbtree<int> h;
+    for (int i = 0; i < N; ++i) {
+        h.insert(i);
+    }
+    testThat(h.memory_usage().index_bytes == h.index_bytes());
+    testThat(h.memory_usage().index_bytes > 0);
+}
+
+void memory2_pool(void)
+{
+    using tree = rbtree<int, std::less<int>, pool_allocator<int>>;
+    tree t;
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        t.insert(i);
+    }
+    auto m = t.memory_usage();
+    testThat(m.pooled);
+    testThat(m.pool.used_slots == size_t(N));
+    testThat(m.pool.slabs == (N + 63) / 64);
+    testThat(m.allocator_bytes == m.pool.slab_bytes);
+    testThat(m.allocator_bytes >= m.node_bytes);
+    testThat(m.fragmentation() < 0.1);
+    // churn leaves the slabs mostly empty
+    for (int i = 0; i < N; ++i) {
+        if (i % 10) t.erase(i);
+    }
+    m = t.memory_usage();
+    testThat(m.pool.used_slots == size_t(N / 10));
+    testThat(m.fragmentation() > 0.85);
+    t.shrink_to_fit();
+    testThat(t.memory_usage().pool.used_slots == size_t(N / 10));
+    testThat(t.size() == size_t(N / 10));
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == (i % 10 == 0));
+    }
+}
+
+void memory3_shrink(void)
+{
+    lazy_rbtree<std::string> t;
+    std::set<std::string> s;
+    std::srand(7);
+    t.shrink_to_fit();
+    t.set_max_tombstone_ratio(0.5f);
+    for (int i = 0; i < 5000; ++i) {
+        auto const k = std::to_string(std::rand() % 2000);
+        if (std::rand() % 3 == 0) {
+            testThat(t.erase(k) == (s.erase(k) == 1));
+        } else {
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+    }
+    t.shrink_to_fit();
+    testThat(t.tombstones() == 0);
+    testThat(t.memory_usage().nodes == s.size());
+    testThat(std::vector<std::string>(t.begin(), t.end()) == std::vector<std::string>(s.begin(), s.end()));
+    for (int i = 0; i < 2000; ++i) {
+        auto const k = std::to_string(i);
+        testThat(t.contains(k) == (s.count(k) == 1));
+    }
+    testThat(t.front() == *s.begin());
+    testThat(t.back() == *s.rbegin());
+
+    // the index follows the nodes
+    hashed_rbtree<int> h;
+    for (int i = 0; i < 500; ++i) {
+        h.insert(i);
+    }
+    for (int i = 0; i < 500; i += 2) {
+        h.erase(i);
+    }
+    h.shrink_to_fit();
+    for (int i = 0; i < 500; ++i) {
+        testThat(h.contains(i) == (i % 2 == 1));
+        testThat(h.erase(i) == (i % 2 == 1));
+    }
+    testThat(h.empty());
+}
+
+void memory3_shrink_fails(void)
+{
+    // an allocation fails halfway
+    rbtree<int, std::less<int>, failing_allocator<int>> t;
+    for (int i = 0; i < 100; ++i) {
+        t.insert(i);
+    }
+    g_fail_after = 50;
+    bool threw = false;
+    try {
+        t.shrink_to_fit();
+    } catch (std::bad_alloc const&) {
+        threw = true;
+    }
+    g_fail_after = -1;
+    testThat(threw);
+    testThat(t.size() == 100);
+    testThat(std::vector<int>(t.begin(), t.end()).size() == 100);
+
+    // a copy fails halfway; elements that may throw on move are copied
+    rbtree<fragile> f;
+    for (int i = 0; i < 100; ++i) {
+        f.insert(fragile(i));
+    }
+    g_copies_left = 50;
+    threw = false;
+    try {
+        f.shrink_to_fit();
+    } catch (std::runtime_error const&) {
+        threw = true;
+    }
+    g_copies_left = -1;
+    testThat(threw);
+    testThat(f.size() == 100);
+    int expect = 0;
+    for (auto const& x : f) {
+        testThat(x.v == expect++);
+    }
+    f.shrink_to_fit();
+    testThat(f.size() == 100);
+}
+
+namespace {
+
+// ten in-order scans, which must add up to ten times sum
+template<class Tree>
+void time_scan(Tree const& t, size_t sum)
+{
+    auto a = std::chrono::high_resolution_clock::now();
+    size_t got = 0;
+    for (int r = 0; r < 10; ++r) {
+        for (auto x : t) {
+            got += x;
+        }
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(got == sum * 10);
+    std::cout << "scan: ";
+    print_time_taken(a, b);
+}
+
+// Churn scatters the nodes: insert 4N random keys, erase all but N of
+// them, and time in-order scans before and after shrink_to_fit.
+template<class Tree>
+void time_shrink(char const* name)
+{
+    Tree t;
+    std::set<size_t> s;
+    std::vector<size_t> keys(PERFN * 4);
+    std::srand(19);
+    for (auto& k : keys) {
+        k = std::size_t(std::rand());
+        t.insert(k);
+        s.insert(k);
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (i % 4) {
+            t.erase(keys[i]);
+            s.erase(keys[i]);
+        }
+    }
+    size_t sum = 0;
+    for (auto x : s) {
+        sum += x;
+    }
+    std::cout << name << " ";
+    time_scan(t, sum);
+    auto a = std::chrono::high_resolution_clock::now();
+    t.shrink_to_fit();
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(t.size() == s.size());
+    std::cout << "shrink: ";
+    print_time_taken(a, b);
+    time_scan(t, sum);
+}
+
+} // namespace
+
+void rbt3_time_shrink(void)
+{
+    time_shrink<rbtree<size_t>>("rbtree<size_t>");
+}
+
+void pool3_time_shrink(void)
+{
+    time_shrink<rbtree<size_t, std::less<size_t>, pool_allocator<size_t>>>("rbtree<size_t, pool>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(memory)
+{
+    addTest(memory0);
+    addTest(memory1_payload);
+    addTest(memory2_pool);
+    addTest(memory3_shrink);
+    addTest(memory3_shrink_fails);
+    addTest(rbt3_time_shrink);
+    addTest(pool3_time_shrink);
+}
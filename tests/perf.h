@@ -0,0 +1,29 @@
+/*! perf.h */
+
+#ifndef _TESTS_PERF_H_
+#define _TESTS_PERF_H_
+
+// shared by the timing tests (the *3_time_* ones); the element count can
+// be set with the N environment variable
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+
+#ifdef NDEBUG
+const size_t PERFN_DEFL = 10000;
+#else
+const size_t PERFN_DEFL = 1000;
+#endif
+
+const size_t PERFN = std::getenv("N") ? std::atoi(std::getenv("N")) : PERFN_DEFL;
+
+template<class T>
+void print_time_taken(T a, T b)
+{
+    auto diff = b - a;
+    std::cout << std::chrono::duration<double, std::milli>(diff).count() << " : ";
+}
+
+#endif/*_TESTS_PERF_H_*/
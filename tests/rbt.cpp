@@ -1,12 +1,15 @@
 /*! rbt.cpp */
 
 #include "defs.h"
+#include "perf.h"
 
 #include <rbtree/rbtree.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <queue>
 #include <set>
 
 #include <string>
@@ -35,7 +38,8 @@ using namespace containers;
 void rbt0(void)
 {
     rbtree<int> t;
-    testThat(sizeof(t) == 3*sizeof(void*));
+    // root, cached extremes, size and comparator; no tombstone state
+    testThat(sizeof(t) == 5*sizeof(void*));
     testThat(t.size() == 0);
     testThat(t.empty());
 }
@@ -105,25 +109,393 @@ void rbt2(void)
     }
 }
 
+void rbt2_range(void)
+{
+    rbtree<int> t;
+    const int N = 100;
+    // even keys only
+    for (int i = 0; i < N; ++i) {
+        testThat(t.insert(2*i) == true);
+    }
+    // iteration
+    int expect = 0;
+    for (auto it = t.begin(); it != t.end(); ++it) {
+        testThat(*it == expect);
+        expect += 2;
+    }
+    testThat(expect == 2*N);
+    testThat(*(--t.end()) == 2*(N-1));
+    // bounds
+    testThat(*t.lower_bound(10) == 10);
+    testThat(*t.lower_bound(11) == 12);
+    testThat(*t.upper_bound(10) == 12);
+    testThat(*t.upper_bound(11) == 12);
+    testThat(t.lower_bound(-5) == t.begin());
+    testThat(t.lower_bound(2*N) == t.end());
+    testThat(t.upper_bound(2*(N-1)) == t.end());
+    // equal range
+    auto r = t.equal_range(20);
+    testThat(r.first != r.second);
+    testThat(*r.first == 20);
+    testThat(*r.second == 22);
+    r = t.equal_range(21);
+    testThat(r.first == r.second);
+    testThat(*r.first == 22);
+    // visitor
+    for (int lo = -3; lo < 2*N + 3; lo += 3) {
+        for (int hi = lo; hi < 2*N + 3; hi += 7) {
+            std::vector<int> got;
+            t.for_each_in_range(lo, hi, [&](int x) { got.push_back(x); });
+            std::vector<int> want;
+            for (int x = 0; x < 2*N; x += 2) {
+                if (x >= lo && x < hi) want.push_back(x);
+            }
+            testThat(got == want);
+        }
+    }
+}
+
+void rbt2_erase(void)
+{
+    rbtree<int> t;
+    std::set<int> s;
+    std::srand(1);
+    for (int i = 0; i < 20000; ++i) {
+        int x = std::rand() % 1000;
+        if (std::rand() % 2) {
+            testThat(t.erase(x) == (s.erase(x) == 1));
+        } else {
+            testThat(t.insert(x) == s.insert(x).second);
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(t.tombstones() == 0);
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    for (int x : s) {
+        testThat(t.erase(x) == true);
+    }
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+}
+
+void rbt2_lazy_erase(void)
+{
+    lazy_rbtree<int> t;
+    t.set_max_tombstone_ratio(0.5f);
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.insert(i) == true);
+    }
+    // erase marks tombstones until they pass half the live size
+    for (int i = 0; i < 30; ++i) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+        testThat(t.contains(i) == false);
+    }
+    testThat(t.size() == size_t(N - 30));
+    testThat(t.tombstones() == 30);
+    testThat(*t.begin() == 30);
+    testThat(*t.lower_bound(5) == 30);
+    testThat(*t.upper_bound(5) == 30);
+    auto r = t.equal_range(10);
+    testThat(r.first == r.second);
+    std::vector<int> got;
+    t.for_each_in_range(0, 40, [&](int x) { got.push_back(x); });
+    testThat(got.size() == 10 && got.front() == 30);
+    // reinserting a tombstoned key revives its node
+    testThat(t.insert(10) == true);
+    testThat(t.contains(10) == true);
+    testThat(t.tombstones() == 29);
+    testThat(*t.begin() == 10);
+    testThat(t.erase(10) == true);
+    // passing the threshold rebuilds without tombstones
+    for (int i = 30; i < 33; ++i) {
+        testThat(t.erase(i) == true);
+    }
+    testThat(t.tombstones() == 33);
+    testThat(t.erase(33) == true);
+    testThat(t.tombstones() == 0);
+    testThat(t.size() == size_t(N - 34));
+    int expect = 34;
+    for (auto x : t) {
+        testThat(x == expect++);
+    }
+    testThat(expect == N);
+    testThat(*(--t.end()) == N - 1);
+    // incremental compaction within a work budget
+    for (int i = 50; i < 70; ++i) {
+        testThat(t.erase(i) == true);
+    }
+    testThat(t.tombstones() == 20);
+    int calls = 0;
+    while (!t.compact(8)) {
+        ++calls;
+        testThat(t.contains(49) && t.contains(70));
+    }
+    testThat(calls > 1);
+    testThat(t.tombstones() == 0);
+    testThat(t.size() == size_t(N - 54));
+    // a budget covering the whole tree rebuilds it in one call
+    for (int i = 80; i < 90; ++i) {
+        testThat(t.erase(i) == true);
+    }
+    testThat(t.compact(8) == false);
+    testThat(t.compact(N) == true);
+    testThat(t.tombstones() == 0);
+    testThat(t.size() == size_t(N - 64));
+    testThat(t.contains(79) && !t.contains(85) && t.contains(90));
+    // back to eager erase
+    t.set_max_tombstone_ratio(0);
+    testThat(t.erase(40) == true);
+    testThat(t.tombstones() == 0);
+    t.clear();
+    testThat(t.empty());
+}
+
+void rbt2_front_back(void)
+{
+    rbtree<int> t;
+    std::set<int> s;
+    std::srand(3);
+    for (int i = 0; i < 2000; ++i) {
+        int x = std::rand() % 500;
+        testThat(t.insert(x) == s.insert(x).second);
+        testThat(t.front() == *s.begin());
+        testThat(t.back() == *s.rbegin());
+    }
+    while (!s.empty()) {
+        testThat(t.front() == *s.begin());
+        testThat(t.back() == *s.rbegin());
+        if (s.size() % 2) {
+            t.pop_front();
+            s.erase(s.begin());
+        } else {
+            t.pop_back();
+            s.erase(--s.end());
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    // tombstones at the extremes are skipped and cleaned up by pops
+    lazy_rbtree<int> l;
+    l.set_max_tombstone_ratio(4.0f);
+    for (int i = 0; i < 10; ++i) {
+        l.insert(i);
+    }
+    l.erase(0);
+    l.erase(1);
+    l.erase(9);
+    testThat(l.front() == 2);
+    testThat(l.back() == 8);
+    l.pop_front();
+    testThat(l.tombstones() == 1);
+    testThat(l.front() == 3);
+    l.pop_back();
+    testThat(l.tombstones() == 0);
+    testThat(l.back() == 7);
+    testThat(l.size() == 5);
+}
+
+void rbt2_string_prefix(void)
+{
+    rbtree<std::string> t;
+    std::set<std::string> s;
+    std::vector<std::string> keys = {
+        "", "a", std::string("a\0", 2), std::string("a\0\0", 3), "ab", "abcdefgh", "abcdefghi",
+        "abcdefgh\xff", "abcdefgi", "\x7f", "\x80", "\xff\xff", "zzzzzzzzzzzzzzzzzzzz",
+        "common-prefix-1", "common-prefix-2", "common-prefix-10"
+    };
+    for (auto const& k : keys) {
+        testThat(t.insert(k) == s.insert(k).second);
+    }
+    for (auto const& k : keys) {
+        testThat(t.insert(k) == false);
+        testThat(t.contains(k) == true);
+    }
+    testThat(t.contains("abcdefg") == false);
+    testThat(t.contains(std::string("a\0\0\0", 4)) == false);
+    testThat(std::vector<std::string>(t.begin(), t.end()) ==
+             std::vector<std::string>(s.begin(), s.end()));
+    testThat(*t.lower_bound("abcdefgh0") == "abcdefghi");
+    testThat(*t.upper_bound("abcdefghi") == "abcdefgh\xff");
+    testThat(t.erase("abcdefgh") == true);
+    testThat(t.contains("abcdefgh") == false);
+    testThat(t.contains("abcdefghi") == true);
+}
+
 namespace {
 
-template<class T>
-void print_time_taken(T a, T b)
+template<class Tree>
+void check_erase_range(Tree& t)
 {
-    auto diff = b - a;
-    std::cout << std::chrono::duration<double, std::milli>(diff).count() << " : ";
+    std::set<int> s;
+    int const n = std::rand() % 300;
+    for (int i = 0; i < n; ++i) {
+        int x = std::rand() % 1000;
+        testThat(t.insert(x) == s.insert(x).second);
+    }
+    for (int i = 0; i < n / 4; ++i) {
+        int x = std::rand() % 1000;
+        testThat(t.erase(x) == (s.erase(x) == 1));
+    }
+    int lo = std::rand() % 1100 - 50;
+    int hi = lo + std::rand() % 400;
+    auto const expect = std::distance(s.lower_bound(lo), s.lower_bound(hi));
+    testThat(t.erase_range(lo, hi) == size_t(expect));
+    s.erase(s.lower_bound(lo), s.lower_bound(hi));
+    testThat(t.size() == s.size());
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    if (!s.empty()) {
+        testThat(t.front() == *s.begin());
+        testThat(t.back() == *s.rbegin());
+    }
+    // batches of sorted keys, with duplicates and absent keys
+    std::vector<int> keys;
+    for (int i = 0; i < 100; ++i) {
+        keys.push_back(std::rand() % 1000);
+    }
+    std::sort(keys.begin(), keys.end());
+    size_t removed = 0;
+    for (auto k : keys) {
+        removed += s.erase(k);
+    }
+    testThat(t.erase_batch(keys.begin(), keys.end()) == removed);
+    testThat(t.size() == s.size());
+    testThat(std::vector<int>(t.begin(), t.end()) == std::vector<int>(s.begin(), s.end()));
+    testThat(t.erase_range(-1, 1001) == s.size());
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
 }
 
-#ifdef NDEBUG
-const size_t PERFN_DEFL = 10000;
-#else
-const size_t PERFN_DEFL = 1000;
-#endif
+} // namespace
 
-const size_t PERFN = std::getenv("N") ? std::atoi(std::getenv("N")) : PERFN_DEFL;
+void rbt2_erase_range(void)
+{
+    std::srand(5);
+    for (int round = 0; round < 100; ++round) {
+        rbtree<int> t;
+        check_erase_range(t);
+        lazy_rbtree<int> l;
+        l.set_max_tombstone_ratio(0.5f);
+        check_erase_range(l);
+    }
+    rbtree<int> t;
+    testThat(t.erase_range(0, 10) == 0);
+    testThat(t.erase_batch((int*)nullptr, (int*)nullptr) == 0);
+    for (int i = 0; i < 10; ++i) {
+        t.insert(i);
+    }
+    testThat(t.erase_range(5, 5) == 0);
+    testThat(t.erase_range(7, 3) == 0);
+    testThat(t.erase_range(3, 7) == 4);
+    testThat(t.contains(2) && !t.contains(3) && !t.contains(6) && t.contains(7));
+    // keys converted to Data, long enough to live on the heap
+    std::vector<std::string> names;
+    rbtree<std::string> u;
+    for (int i = 0; i < 40; ++i) {
+        names.push_back("a key too long to be stored inline " + std::to_string(100 + i));
+        u.insert(names.back());
+    }
+    std::vector<char const*> c;
+    for (size_t i = 0; i < names.size(); i += 3) {
+        c.push_back(names[i].c_str());
+    }
+    testThat(u.erase_batch(c.begin(), c.end()) == c.size());
+    testThat(u.erase_batch(c.begin(), c.end()) == 0);
+    for (size_t i = 0; i < names.size(); ++i) {
+        testThat(u.contains(names[i]) == (i % 3 != 0));
+    }
+    rbtree<long> l;
+    for (long i = 0; i < 100; ++i) {
+        l.insert(i);
+    }
+    std::vector<int> ints({-5, 0, 7, 7, 50, 99, 150});
+    testThat(l.erase_batch(ints.begin(), ints.end()) == 4);
+    testThat(l.size() == 96);
+}
+
+namespace {
+
+size_t g_allocs = 0;
+
+// std::allocator that counts allocations
+template<class T>
+struct counting_allocator : std::allocator<T>
+{
+    template<class U>
+    struct rebind { using other = counting_allocator<U>; };
+
+    counting_allocator() = default;
+    template<class U>
+    counting_allocator(counting_allocator<U> const&)
+    { }
+
+    T* allocate(size_t n)
+    {
+        ++g_allocs;
+        return std::allocator<T>::allocate(n);
+    }
+};
 
 } // namespace
 
+void rbt2_node_handle(void)
+{
+    // handles move between eager and lazy trees alike
+    using alloc = counting_allocator<std::string>;
+    lazy_rbtree<std::string, std::less<std::string>, alloc> active;
+    rbtree<std::string, std::less<std::string>, alloc> expired;
+    for (int i = 0; i < 100; ++i) {
+        active.insert("key-" + std::to_string(i));
+    }
+    auto const allocs = g_allocs;
+    // moving between trees neither allocates nor copies
+    for (int i = 0; i < 100; i += 2) {
+        auto nh = active.extract("key-" + std::to_string(i));
+        testThat(!nh.empty());
+        testThat(expired.insert(std::move(nh)) == true);
+        testThat(nh.empty());
+    }
+    testThat(g_allocs == allocs);
+    testThat(active.size() == 50);
+    testThat(expired.size() == 50);
+    for (int i = 0; i < 100; ++i) {
+        auto const k = "key-" + std::to_string(i);
+        testThat(active.contains(k) == (i % 2 == 1));
+        testThat(expired.contains(k) == (i % 2 == 0));
+    }
+    testThat(active.extract("missing").empty());
+    // the key can change while detached
+    auto nh = expired.extract("key-0");
+    testThat(nh.value() == "key-0");
+    nh.value() = "key-1";
+    testThat(active.insert(std::move(nh)) == false);
+    testThat(!nh.empty());
+    nh.value() = "aaa";
+    testThat(active.insert(std::move(nh)) == true);
+    testThat(active.front() == "aaa");
+    testThat(g_allocs == allocs);
+    // a handle that is never reinserted frees its node
+    {
+        auto dropped = active.extract("aaa");
+        testThat(dropped.value() == "aaa");
+    }
+    testThat(active.contains("aaa") == false);
+    testThat(active.size() == 50);
+    // an equal tombstone takes over the value instead
+    active.set_max_tombstone_ratio(1.0f);
+    testThat(active.erase("key-1") == true);
+    testThat(active.tombstones() == 1);
+    nh = expired.extract("key-2");
+    nh.value() = "key-1";
+    testThat(active.insert(std::move(nh)) == true);
+    testThat(nh.empty());
+    testThat(active.tombstones() == 0);
+    testThat(active.contains("key-1") == true);
+    testThat(g_allocs == allocs);
+}
+
 void rbt3_time_int(void)
 {
     rbtree<int> t;
@@ -242,6 +614,177 @@ void stdset3_time_string_move(void)
     print_time_taken(a, b);
 }
 
+namespace {
+
+std::vector<std::string> lookup_strings(size_t n)
+{
+    // keys share the leading bytes, as identifiers and paths tend to
+    std::vector<std::string> strs;
+    strs.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        strs.push_back("key:" + std::to_string((i * 2654435761u) % n));
+    }
+    return strs;
+}
+
+} // namespace
+
+void stdset3_time_string_lookup(void)
+{
+    auto strs = lookup_strings(PERFN);
+    std::set<std::string> t(strs.begin(), strs.end());
+    auto a = std::chrono::high_resolution_clock::now();
+    size_t found = 0;
+    for (auto const& k : strs) {
+        found += t.count(k);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(found == strs.size());
+    std::cout << "std::set<std::string> lookup: ";
+    print_time_taken(a, b);
+}
+
+void rbt3_time_string_lookup(void)
+{
+    auto strs = lookup_strings(PERFN);
+    rbtree<std::string> t;
+    for (auto const& k : strs) {
+        t.insert(k);
+    }
+    auto a = std::chrono::high_resolution_clock::now();
+    size_t found = 0;
+    for (auto const& k : strs) {
+        found += t.contains(k);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(found == strs.size());
+    std::cout << "rbtree<std::string> lookup: ";
+    print_time_taken(a, b);
+}
+
+namespace {
+
+// timer workload: a fixed number of pending deadlines; each step fires the
+// earliest one and schedules a new deadline after it. keys carry a sequence
+// number in their low bits so that they stay unique.
+const size_t TIMERS = 1024;
+
+size_t next_deadline(size_t now, size_t seq)
+{
+    return (((now >> 20) + 1 + (seq * 2654435761u) % 1000) << 20) | (seq & 0xfffff);
+}
+
+} // namespace
+
+void pq3_time_timer(void)
+{
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> q;
+    size_t seq = 0;
+    for (; seq < TIMERS; ++seq) {
+        q.push(next_deadline(0, seq));
+    }
+    const size_t N = PERFN * 10;
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i, ++seq) {
+        auto now = q.top();
+        q.pop();
+        q.push(next_deadline(now, seq));
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(q.size() == TIMERS);
+    std::cout << "std::priority_queue<size_t> timers: ";
+    print_time_taken(a, b);
+}
+
+void stdset3_time_timer(void)
+{
+    std::set<size_t> t;
+    size_t seq = 0;
+    for (; seq < TIMERS; ++seq) {
+        t.insert(next_deadline(0, seq));
+    }
+    const size_t N = PERFN * 10;
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i, ++seq) {
+        auto now = *t.begin();
+        t.erase(t.begin());
+        t.insert(next_deadline(now, seq));
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(t.size() == TIMERS);
+    std::cout << "std::set<size_t> timers: ";
+    print_time_taken(a, b);
+}
+
+void rbt3_time_timer(void)
+{
+    rbtree<size_t> t;
+    size_t seq = 0;
+    for (; seq < TIMERS; ++seq) {
+        t.insert(next_deadline(0, seq));
+    }
+    const size_t N = PERFN * 10;
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i, ++seq) {
+        auto now = t.front();
+        t.pop_front();
+        t.insert(next_deadline(now, seq));
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(t.size() == TIMERS);
+    std::cout << "rbtree<size_t> timers: ";
+    print_time_taken(a, b);
+}
+
+namespace {
+
+// expiring everything below a watermark, a quarter of the keys at a time;
+// expire(t, first, last) removes the sorted keys [first, last)
+template<class Expire>
+void time_expire(char const* name, Expire expire)
+{
+    rbtree<size_t> t;
+    const size_t N = PERFN * 10;
+    std::vector<size_t> keys(N);
+    for (size_t i = 0; i < N; ++i) {
+        t.insert((i * 2654435761u) % N);
+        keys[i] = i;
+    }
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t q = 1; q <= 4; ++q) {
+        expire(t, keys.data() + (q - 1) * N / 4, keys.data() + q * N / 4);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    testThat(t.empty());
+    std::cout << name << ": ";
+    print_time_taken(a, b);
+}
+
+} // namespace
+
+void rbt3_time_expire_loop(void)
+{
+    time_expire("rbtree<size_t> erase loop", [](rbtree<size_t>& t, size_t const* first, size_t const* last) {
+        for (; first != last; ++first) {
+            t.erase(*first);
+        }
+    });
+}
+
+void rbt3_time_expire_batch(void)
+{
+    time_expire("rbtree<size_t> erase_batch", [](rbtree<size_t>& t, size_t const* first, size_t const* last) {
+        t.erase_batch(first, last);
+    });
+}
+
+void rbt3_time_expire_range(void)
+{
+    time_expire("rbtree<size_t> erase_range", [](rbtree<size_t>& t, size_t const* first, size_t const* last) {
+        t.erase_range(*first, last[-1] + 1);
+    });
+}
+
 //////////////////////////////////////////
 
 setupSuite(rbt)
@@ -249,10 +792,25 @@ setupSuite(rbt)
     addTest(rbt0);
     addTest(rbt1);
     addTest(rbt2);
+    addTest(rbt2_range);
+    addTest(rbt2_erase);
+    addTest(rbt2_lazy_erase);
+    addTest(rbt2_front_back);
+    addTest(rbt2_string_prefix);
+    addTest(rbt2_node_handle);
+    addTest(rbt2_erase_range);
     addTest(stdset3_time_int);
     addTest(rbt3_time_int);
     addTest(stdset3_time_size);
     addTest(rbt3_time_size);
     addTest(stdset3_time_string_move);
     addTest(rbt3_time_string_move);
+    addTest(stdset3_time_string_lookup);
+    addTest(rbt3_time_string_lookup);
+    addTest(pq3_time_timer);
+    addTest(stdset3_time_timer);
+    addTest(rbt3_time_timer);
+    addTest(rbt3_time_expire_loop);
+    addTest(rbt3_time_expire_batch);
+    addTest(rbt3_time_expire_range);
 }
@@ -0,0 +1,170 @@
+/*! static.cpp */
+
+#include "defs.h"
+#include "perf.h"
+
+#include <rbtree/static_rbtree.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace containers;
+
+void static0(void)
+{
+    static_rbtree<int, 16> t;
+    testThat(t.size() == 0);
+    testThat(t.empty());
+    testThat(!t.full());
+    testThat(t.begin() == t.end());
+    static_assert(static_rbtree<int, 16>::capacity() == 16, "capacity is a constant expression");
+    // links shrink with the capacity
+    testThat(sizeof(_rbtree_index_t<126>) == 1);
+    testThat(sizeof(_rbtree_index_t<127>) == 2);
+    testThat(sizeof(_rbtree_index_t<40000>) == 4);
+    testThat(sizeof(_rbtree_index_node<int, uint8_t>) == 2*sizeof(int));
+    testThat(sizeof(static_rbtree<int, 16>) <= 16*sizeof(_rbtree_index_node<int, uint8_t>) + 2*sizeof(void*));
+}
+
+void static1(void)
+{
+    const int N = 100;
+    static_rbtree<int, N> t;
+    for (int i = 0; i < N; ++i) {
+        testThat(t.contains(i) == false);
+        testThat(t.insert(i) == true);
+        testThat(t.insert(i) == false);
+        testThat(t.size() == size_t(i + 1));
+        testThat(t.contains(i) == true);
+    }
+    testThat(t.full());
+    // duplicates are still rejected quietly when full; new keys throw
+    testThat(t.insert(0) == false);
+    bool threw = false;
+    try {
+        t.insert(N);
+    } catch (std::length_error const&) {
+        threw = true;
+    }
+    testThat(threw);
+    testThat(t.size() == size_t(N));
+    int expect = 0;
+    for (auto x : t) {
+        testThat(x == expect++);
+    }
+    testThat(expect == N);
+    // erased slots are reused
+    for (int i = 0; i < N; i += 2) {
+        testThat(t.erase(i) == true);
+        testThat(t.erase(i) == false);
+    }
+    for (int i = 0; i < N; i += 2) {
+        testThat(t.insert(N + i) == true);
+    }
+    testThat(t.full());
+    for (int i = 0; i < 2*N; ++i) {
+        testThat(t.contains(i) == (i >= N ? (i - N) % 2 == 0 : i % 2 == 1));
+    }
+    t.clear();
+    testThat(t.empty());
+    testThat(t.begin() == t.end());
+    testThat(t.insert(5) == true);
+}
+
+void static2_random(void)
+{
+    static_rbtree<std::string, 1000> t;
+    std::set<std::string> s;
+    std::srand(11);
+    for (int i = 0; i < 20000; ++i) {
+        auto k = std::to_string(std::rand() % 1500);
+        if (std::rand() % 2 == 0) {
+            testThat(t.erase(k) == (s.erase(k) == 1));
+        } else if (!t.full()) {
+            testThat(t.insert(k) == s.insert(k).second);
+        }
+        testThat(t.size() == s.size());
+    }
+    testThat(std::vector<std::string>(t.begin(), t.end()) ==
+             std::vector<std::string>(s.begin(), s.end()));
+    auto it = t.end();
+    for (auto sit = s.rbegin(); sit != s.rend(); ++sit) {
+        testThat(*--it == *sit);
+    }
+    testThat(it == t.begin());
+    for (int i = 0; i < 1500; i += 13) {
+        auto k = std::to_string(i);
+        auto lb = t.lower_bound(k);
+        auto slb = s.lower_bound(k);
+        testThat((lb == t.end()) == (slb == s.end()));
+        if (slb != s.end()) testThat(*lb == *slb);
+        auto ub = t.upper_bound(k);
+        auto sub = s.upper_bound(k);
+        testThat((ub == t.end()) == (sub == s.end()));
+        if (sub != s.end()) testThat(*ub == *sub);
+    }
+    std::vector<std::string> got;
+    t.for_each_in_range("2", "3", [&](std::string const& x) { got.push_back(x); });
+    testThat(got == std::vector<std::string>(s.lower_bound("2"), s.lower_bound("3")));
+}
+
+namespace {
+
+const size_t CHURN_CAP = 4096;
+
+// steady state churn: a bounded working set with one insert and one erase
+// per step, the use case fixed capacity trees are for
+template<class Tree>
+void time_churn(Tree& t, char const* name)
+{
+    const size_t N = PERFN * 10;
+    std::set<size_t> s;
+    for (size_t i = 0; i < CHURN_CAP / 2; ++i) {
+        t.insert(i);
+        s.insert(i);
+    }
+    auto a = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i) {
+        t.erase((i * 40503u) % CHURN_CAP);
+        t.insert((i * 2654435761u) % CHURN_CAP);
+    }
+    auto b = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < N; ++i) {
+        s.erase((i * 40503u) % CHURN_CAP);
+        s.insert((i * 2654435761u) % CHURN_CAP);
+    }
+    testThat(t.size() == s.size());
+    testThat(std::vector<size_t>(t.begin(), t.end()) == std::vector<size_t>(s.begin(), s.end()));
+    std::cout << name << ": ";
+    print_time_taken(a, b);
+}
+
+} // namespace
+
+void rbt3_time_churn_size(void)
+{
+    rbtree<size_t> t;
+    time_churn(t, "rbtree<size_t>");
+}
+
+void static3_time_churn_size(void)
+{
+    static static_rbtree<size_t, CHURN_CAP> t;
+    time_churn(t, "static_rbtree<size_t>");
+}
+
+//////////////////////////////////////////
+
+setupSuite(static_rbt)
+{
+    addTest(static0);
+    addTest(static1);
+    addTest(static2_random);
+    addTest(rbt3_time_churn_size);
+    addTest(static3_time_churn_size);
+}
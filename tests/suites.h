@@ -2,3 +2,11 @@
 
 runSuite(exports);
 runSuite(rbt);
+runSuite(fat);
+runSuite(compact);
+runSuite(capi);
+runSuite(static_rbt);
+runSuite(hashed);
+runSuite(balance);
+runSuite(buffered);
+runSuite(memory);